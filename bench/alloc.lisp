@@ -0,0 +1,12 @@
+; Allocation stress: short-lived lists next to a long-lived one.
+(define (iota n acc)
+  (if (= n 0) acc (iota (- n 1) (cons n acc))))
+(define (length l n)
+  (if (null l) n (length (cdr l) (+ n 1))))
+(define big (iota 100000 nil))
+(define (churn k)
+  (if (= k 0)
+      'done
+      (progn (iota 1000 nil) (churn (- k 1)))))
+(println (churn 2000))
+(println (length (reverse big) 0))
@@ -0,0 +1,14 @@
+; Closure creation and calls through higher-order procedures.
+(define (make-adder n) (lambda (x) (+ x n)))
+(define (compose f g) (lambda (x) (f (g x))))
+(define (map f l)
+  (if (null l) nil (cons (f (car l)) (map f (cdr l)))))
+(define (iota n acc)
+  (if (= n 0) acc (iota (- n 1) (cons n acc))))
+(define nums (iota 100 nil))
+(define (run k acc)
+  (if (= k 0)
+      acc
+      (run (- k 1)
+           (car (map (compose (make-adder k) (make-adder acc)) nums)))))
+(println (run 3000 0))
@@ -0,0 +1,13 @@
+; List construction and reversal with the stdlib reverse and append-2.
+(define (iota n acc)
+  (if (= n 0) acc (iota (- n 1) (cons n acc))))
+(define (length l)
+  (define (length-iter l n)
+    (if (null l) n (length-iter (cdr l) (+ n 1))))
+  (length-iter l 0))
+(define (repeat k acc)
+  (if (= k 0)
+      acc
+      (repeat (- k 1)
+              (length (append-2 (reverse (iota 100 nil)) (iota 100 nil))))))
+(println (repeat 300 0))
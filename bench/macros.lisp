@@ -0,0 +1,13 @@
+; Loops whose bodies use let*, progn, and and or from stdlib.lisp.
+(define (step i acc)
+  (let* ((a (+ i 1))
+         (b (+ a 1))
+         (c (+ b 1)))
+    (progn
+      (and a b c)
+      (or nil (+ acc c)))))
+(define (loop i acc)
+  (if (= i 0)
+      acc
+      (loop (- i 1) (step i acc))))
+(println (loop 100000 0))
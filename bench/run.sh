@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs every benchmark once and prints one line of key=value pairs per
+# benchmark: its name, wall time in milliseconds and the interpreter's
+# --stats counters. Extra interpreter flags can be passed in BENCH_FLAGS.
+cd "$(dirname "$0")/.." || exit 1
+status=0
+for file in bench/*.lisp; do
+    name=$(basename "$file" .lisp)
+    start=$(date +%s%N)
+    if ! stats=$(./mehlisp --stats $BENCH_FLAGS stdlib.lisp "$file" \
+                 2>&1 >/dev/null); then
+        echo "name=$name failed"
+        status=1
+        continue
+    fi
+    end=$(date +%s%N)
+    echo "name=$name wall_ms=$(((end - start) / 1000000)) $stats"
+done
+exit $status
@@ -1,12 +1,27 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
-#include <functional>
 #include <iostream>
-#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
@@ -17,99 +32,522 @@ using namespace std;
         exit(1);                      \
     } while (0)
 
-struct trie {
-    struct node {
-        int ch[128], father;
-        char path;
-        node() {
-            path = 0;
-            for (int i = 0; i < 128; i++) ch[i] = -1;
-            father = -1;
+struct symbol_table {
+    // names are stored back to back in one pool; a symbol is an index into
+    // offsets/lengths, found through an open-addressed hash table
+    string pool;
+    vector<int> offsets, lengths;
+    vector<unsigned> hashes;
+    vector<int> slots;
+    symbol_table() : slots(1024, -1) {
+        for (auto s : {"nil", "t", "quote", "if", "set!", "lambda", "syntax"})
+            intern(s, strlen(s));
+    }
+    static unsigned hash(const char *s, int n) {
+        unsigned h = 2166136261u;
+        for (int i = 0; i < n; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+        return h;
+    }
+    string_view name(int id) const {
+        return string_view(pool.data() + offsets[id], lengths[id]);
+    }
+    void rehash() {
+        slots.assign(slots.size() * 2, -1);
+        unsigned mask = slots.size() - 1;
+        for (int id = 0; id < (int)hashes.size(); id++) {
+            unsigned i = hashes[id] & mask;
+            while (slots[i] >= 0) i = (i + 1) & mask;
+            slots[i] = id;
         }
-    };
-    vector<node> nodes;
-    trie() { nodes.emplace_back(); }
+    }
     int intern(const char *s, int n) {
-        int u = 0;
-        for (int i = 0; i < n; i++) {
-            int &v = nodes[u].ch[(int)s[i]];
-            if (v < 0) {
-                v = nodes.size();
-                nodes.emplace_back();
-                nodes.back().path = s[i];
-                nodes.back().father = u;
-            }
-            u = v;
+        unsigned h = hash(s, n), mask = slots.size() - 1;
+        unsigned i = h & mask;
+        for (; slots[i] >= 0; i = (i + 1) & mask) {
+            int id = slots[i];
+            if (hashes[id] == h && lengths[id] == n &&
+                memcmp(pool.data() + offsets[id], s, n) == 0)
+                return id;
         }
-        return u;
+        int id = offsets.size();
+        offsets.push_back(pool.size());
+        lengths.push_back(n);
+        hashes.push_back(h);
+        pool.append(s, n);
+        slots[i] = id;
+        if (offsets.size() * 2 > slots.size()) rehash();
+        return id;
     }
 };
 
-trie obarray;
+symbol_table obarray;
+
+// symbols interned by the symbol_table constructor, in order
+enum symbol_id { SNIL, ST, SQUOTE, SIF, SSET, SLAMBDA, SSYNTAX };
 
 enum type_t {
     TNUM,
+    TFIX,
     TSYM,
     TIPORT,
     TOPORT,
     TPRIM,
     TEOF,
     TUNBOUND,
+    TFORWARD,
+    // types from TPROC to TCONS are stored in cells
     TPROC,
     TMACRO,
     TCONS,
+    // types from TENV on are heap objects
     TENV,
+    TCODE,
+    TVEC,
+    THASH,
 };
 
+// Port objects live in these tables; a port value holds an index into them.
+// A null entry, or an index past the end, is a closed port.
+vector<istream *> istreams;
+vector<ostream *> ostreams;
+
+// A value is a single 64-bit word. Floats are stored as plain doubles;
+// every other value is a negative quiet NaN carrying a 7-bit type tag in
+// bits 44-50 and a 44-bit payload (fixnum, symbol id, cell index, table
+// index).
+const uint64_t BOX_BITS = 0xfff8000000000000ull;
+const int TAG_SHIFT = 44;
+const uint64_t PAYLOAD_MASK = (1ull << TAG_SHIFT) - 1;
+
 struct ptr {
-    type_t type;
-    union {
-        long double number;
-        int symbol;
-        istream *iport;
-        ostream *oport;
-        long long index;
-    };
+    uint64_t bits;
+    type_t type() const {
+        return (bits & BOX_BITS) == BOX_BITS
+                   ? (type_t)((bits >> TAG_SHIFT) & 0x7f)
+                   : TNUM;
+    }
+    double number() const {
+        double d;
+        memcpy(&d, &bits, sizeof d);
+        return d;
+    }
+    long long index() const { return bits & PAYLOAD_MASK; }
+    long long fixnum() const {
+        return (long long)(bits << (64 - TAG_SHIFT)) >> (64 - TAG_SHIFT);
+    }
+    int symbol() const { return index(); }
+    istream *iport() const {
+        return (size_t)index() < istreams.size() ? istreams[index()] : nullptr;
+    }
+    ostream *oport() const {
+        return (size_t)index() < ostreams.size() ? ostreams[index()] : nullptr;
+    }
 };
 
-ptr intern(const char *s, int n) {
+static_assert(sizeof(ptr) == 8, "values must fit in one word");
+
+ptr make_tagged(type_t type, long long payload) {
     ptr p;
-    p.type = TSYM;
-    p.symbol = obarray.intern(s, n);
+    p.bits = BOX_BITS | (uint64_t)type << TAG_SHIFT | (payload & PAYLOAD_MASK);
     return p;
 }
 
+ptr make_symbol(int id) { return make_tagged(TSYM, id); }
+
+// Slot reported by lookup for a binding in the global environment.
+const long long GLOBAL_SLOT = -1;
+
+ptr intern(const char *s, int n) { return make_symbol(obarray.intern(s, n)); }
+
 ptr intern(const char *s) { return intern(s, strlen(s)); }
 
-vector<ptr> car, cdr;
-vector<bool> mark;
-list<long long> freel, allocl;
-list<ptr *> rootl;
+const ptr s_nil = make_symbol(SNIL), s_t = make_symbol(ST),
+          s_quote = make_symbol(SQUOTE), s_if = make_symbol(SIF),
+          s_set = make_symbol(SSET), s_lambda = make_symbol(SLAMBDA),
+          s_syntax = make_symbol(SSYNTAX);
+
+// Cells live in fixed-size segments, which are added as the heap grows so
+// that growing never copies it. The car and cdr of a cell are adjacent, and
+// each segment has its own mark and remembered bitmaps on the side. Address
+// space for `max_segments` segments is reserved up front and segments are
+// made accessible one at a time, so they follow each other and finding a
+// cell takes no loads. The reservation is at most MAX_SEGMENTS and half the
+// address space limit, and smaller if that cannot be had.
+const int SEGMENT_BITS = 16;
+const long long SEGMENT_CELLS = 1ll << SEGMENT_BITS, MAX_SEGMENTS = 1 << 16;
+struct cell {
+    ptr car, cdr;
+};
+struct segment_bitmaps {
+    uint64_t mark_bits[SEGMENT_CELLS / 64], remembered_bits[SEGMENT_CELLS / 64];
+};
+cell *cells;
+segment_bitmaps *bitmaps;
+long long segment_count = 0, max_segments = 0;
+
+cell &cell_at(long long i) { return cells[i]; }
+
+// The words of the mark and remembered bitmaps holding the bit of cell i.
+uint64_t &mark_word(long long i) {
+    return bitmaps[i >> SEGMENT_BITS].mark_bits[(i & (SEGMENT_CELLS - 1)) >> 6];
+}
+
+uint64_t &remembered_word(long long i) {
+    return bitmaps[i >> SEGMENT_BITS]
+        .remembered_bits[(i & (SEGMENT_CELLS - 1)) >> 6];
+}
+
+// Calls f(cells, n) on each run of consecutive cells in [from, to).
+template <class F>
+void each_cell_run(long long from, long long to, F f) {
+    while (from < to) {
+        auto n = min(to, (from | (SEGMENT_CELLS - 1)) + 1) - from;
+        f(&cell_at(from), n);
+        from += n;
+    }
+}
+
+// Guarded locals are registered on a contiguous shadow stack. Guards are
+// strictly nested, so each one pops exactly the slot it pushed.
+vector<ptr *> root_stack;
+
+// Cells [0, nursery_size) form the nursery, which is bump allocated up to
+// `nursery_top` and emptied by copying survivors into the old space. The
+// old space is [nursery_size, memory_size) and is collected by mark-sweep:
+// cells below `bump` have been handed out at least once, free ones among
+// them are threaded through their car into a list starting at
+// `free_head`, and cells from `bump` on have never been used. A nursery
+// size of 0 turns the generational mode off.
+long long nursery_size = 1 << 16, nursery_top = 0;
+long long heap_size = 1 << 16, memory_size, bump, free_head = -1,
+          free_count = 0;
+double growth_factor = 2;
+// Collector statistics, reported by --stats and (gc-stats). The pause
+// histograms count collections by duration: bucket 0 holds pauses under
+// 1us, bucket i those under 2^i us, and the last one everything longer.
+const int PAUSE_BUCKETS = 20;
+struct gc_statistics {
+    long long cells_allocated, objects_allocated, minor_collections,
+        major_collections, cells_promoted, cells_freed, objects_freed,
+        frames_released, heap_growths;
+    long long minor_pause_total, major_pause_total, minor_pause_max,
+        major_pause_max;  // in microseconds
+    long long minor_pauses[PAUSE_BUCKETS], major_pauses[PAUSE_BUCKETS];
+} gc_stats;
+bool print_stats = false;
+
+// Times a collection for as long as it is in scope.
+struct gc_pause_timer {
+    long long &total, &longest, *histogram;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    ~gc_pause_timer() {
+        long long us = chrono::duration_cast<chrono::microseconds>(
+                           chrono::steady_clock::now() - start)
+                           .count();
+        total += us;
+        longest = max(longest, us);
+        int b = 0;
+        while (b < PAUSE_BUCKETS - 1 && us >= 1ll << b) b++;
+        histogram[b]++;
+    }
+};
+
+// Opt-in profiler (--profile). Procedures and macros are identified by
+// their cell, which the collector reports when it moves or frees one. Each
+// gets an entry named after the first variable it is assigned to, or else
+// after the procedure that created it. Calls are timed on a shadow stack
+// whose paths are kept in a trie for the collapsed-stack output.
+bool profiling = false;
+const char *profile_path = nullptr;
+
+long long profile_clock() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct profiler {
+    struct entry {
+        string name;
+        bool named;
+        long long calls, expansions, self_ns, total_ns;
+        int depth;
+    };
+    struct frame {
+        int entry, node;
+        long long start, child_ns;
+    };
+    struct node {
+        int parent, entry;
+        long long self_ns;
+    };
+    vector<entry> entries;
+    unordered_map<long long, int> by_cell;
+    vector<frame> stack;
+    vector<node> nodes{{-1, -1, 0}};  // node 0 is the root
+    unordered_map<long long, int> children;
+
+    int find(long long cell, type_t type) {
+        auto it = by_cell.find(cell);
+        if (it != by_cell.end()) return it->second;
+        string name = type == TMACRO ? "syntax" : "lambda";
+        if (!stack.empty())
+            name += " in " + entries[stack.back().entry].name;
+        entries.push_back({name, false, 0, 0, 0, 0, 0});
+        return by_cell[cell] = entries.size() - 1;
+    }
+    void name(long long cell, type_t type, string_view name) {
+        auto &e = entries[find(cell, type)];
+        if (e.named) return;
+        e.name = name;
+        e.named = true;
+    }
+    void enter(long long cell, type_t type, bool expansion = false) {
+        int e = find(cell, type);
+        auto &en = entries[e];
+        (expansion ? en.expansions : en.calls)++;
+        en.depth++;
+        int parent = stack.empty() ? 0 : stack.back().node;
+        long long key = (long long)parent << 32 | e;
+        auto it = children.find(key);
+        int n;
+        if (it != children.end()) {
+            n = it->second;
+        } else {
+            n = children[key] = nodes.size();
+            nodes.push_back({parent, e, 0});
+        }
+        stack.push_back({e, n, profile_clock(), 0});
+    }
+    void exit() {
+        auto f = stack.back();
+        stack.pop_back();
+        auto elapsed = profile_clock() - f.start;
+        auto self = elapsed - f.child_ns;
+        auto &en = entries[f.entry];
+        en.self_ns += self;
+        if (--en.depth == 0) en.total_ns += elapsed;
+        nodes[f.node].self_ns += self;
+        if (!stack.empty()) stack.back().child_ns += elapsed;
+    }
+    void moved(long long from, long long to) {
+        auto it = by_cell.find(from);
+        if (it == by_cell.end()) return;
+        int e = it->second;
+        by_cell.erase(it);
+        by_cell[to] = e;
+    }
+    // drops the cells for which `dead` holds; their entries are kept
+    template <typename F>
+    void forget(F dead) {
+        for (auto it = by_cell.begin(); it != by_cell.end();)
+            it = dead(it->first) ? by_cell.erase(it) : next(it);
+    }
+    // Writes the flat profile, summed by name, to `path` and the
+    // collapsed stacks (microseconds of self time) to `path`.folded.
+    void report(const char *path) {
+        while (!stack.empty()) exit();
+        unordered_map<string, entry> flat;
+        for (auto &e : entries) {
+            auto &t = flat.try_emplace(e.name, entry{e.name}).first->second;
+            t.calls += e.calls;
+            t.expansions += e.expansions;
+            t.self_ns += e.self_ns;
+            t.total_ns += e.total_ns;
+        }
+        vector<entry> rows;
+        for (auto &kv : flat)
+            if (kv.second.calls || kv.second.expansions)
+                rows.push_back(kv.second);
+        sort(rows.begin(), rows.end(),
+             [](auto &a, auto &b) { return a.self_ns > b.self_ns; });
+        ofstream out(path);
+        out << "# self_ms total_ms calls expansions name\n";
+        for (auto &r : rows) {
+            char line[64];
+            snprintf(line, sizeof line, "%.3f %.3f %lld %lld ",
+                     r.self_ns / 1e6, r.total_ns / 1e6, r.calls, r.expansions);
+            out << line << r.name << '\n';
+        }
+        // nodes whose paths read the same are merged in one forward pass,
+        // as parents come before their children; the merged paths are then
+        // spelled out depth first in one buffer, each from its parent's
+        vector<int> path_of(nodes.size()), path_parent{-1};
+        vector<string> path_name{""};
+        vector<long long> path_ns{0};
+        map<pair<int, string>, int> paths;
+        for (size_t i = 1; i < nodes.size(); i++) {
+            auto key = make_pair(path_of[nodes[i].parent],
+                                 entries[nodes[i].entry].name);
+            auto it = paths.find(key);
+            if (it == paths.end()) {
+                it = paths.emplace(key, path_ns.size()).first;
+                path_parent.push_back(key.first);
+                path_name.push_back(key.second);
+                path_ns.push_back(0);
+            }
+            path_of[i] = it->second;
+            path_ns[it->second] += nodes[i].self_ns;
+        }
+        vector<vector<int>> kids(path_ns.size());
+        for (size_t p = 1; p < path_ns.size(); p++)
+            kids[path_parent[p]].push_back(p);
+        ofstream stacks(string(path) + ".folded");
+        string folded;
+        vector<pair<int, size_t>> todo;  // path and its parent's length
+        for (auto k : kids[0]) todo.push_back({k, 0});
+        while (!todo.empty()) {
+            auto [p, length] = todo.back();
+            todo.pop_back();
+            folded.resize(length);
+            if (length) folded += ';';
+            folded += path_name[p];
+            if (path_ns[p] >= 1000)
+                stacks << folded << ' ' << path_ns[p] / 1000 << '\n';
+            for (auto k : kids[p]) todo.push_back({k, folded.size()});
+        }
+    }
+} prof;
+
+void report_profile() {
+    if (profiling) prof.report(profile_path);
+}
+// old cells that may point into the nursery, recorded by the write barrier
+vector<long long> remembered;
+
+// The slots or the code of a heap object. It works like a vector, but the
+// items of an object restored from an image are used where the image is
+// mapped, and only copied out once the object grows. Such borrowed items
+// have a capacity of 0.
+template <class T>
+struct object_vector {
+    T *items = nullptr;
+    size_t count = 0, capacity = 0;
+
+    object_vector() = default;
+    object_vector(const object_vector &v) { assign(v.begin(), v.end()); }
+    object_vector(object_vector &&v) noexcept
+        : items(v.items), count(v.count), capacity(v.capacity) {
+        v.items = nullptr;
+        v.count = v.capacity = 0;
+    }
+    object_vector &operator=(object_vector v) noexcept {
+        swap(items, v.items);
+        swap(count, v.count);
+        swap(capacity, v.capacity);
+        return *this;
+    }
+    ~object_vector() {
+        if (capacity) free(items);
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
+    T *data() { return items; }
+    const T *data() const { return items; }
+    T *begin() { return items; }
+    T *end() { return items + count; }
+    const T *begin() const { return items; }
+    const T *end() const { return items + count; }
+    T &operator[](size_t i) { return items[i]; }
+    const T &operator[](size_t i) const { return items[i]; }
+
+    // Makes room for n items, keeping the first count.
+    void reserve(size_t n) {
+        if (n <= capacity) return;
+        n = max(n, 2 * capacity);
+        auto p = (T *)malloc(n * sizeof(T));
+        if (!p) ERR_EXIT("Out of memory");
+        if (count) memcpy((void *)p, items, count * sizeof(T));
+        if (capacity) free(items);
+        items = p;
+        capacity = n;
+    }
+    void borrow(T *p, size_t n) {
+        if (capacity) free(items);
+        items = p;
+        count = n;
+        capacity = 0;
+    }
+    void clear() {
+        if (!capacity) items = nullptr;
+        count = 0;
+    }
+    void push_back(T x) {
+        reserve(count + 1);
+        items[count++] = x;
+    }
+    void assign(size_t n, T fill) {
+        clear();
+        reserve(n);
+        std::fill(items, items + n, fill);
+        count = n;
+    }
+    template <class I>
+    void assign(I first, I last) {
+        clear();
+        reserve(last - first);
+        count = copy(first, last, items) - items;
+    }
+};
 
-long long memory_size = 1;
+// Heap objects hold any number of slots and never move; a value of an
+// object type carries the object's id. Objects created since the last minor
+// collection are young and are freed by it unless reachable, old objects
+// are swept by full collections.
+struct heap_object {
+    object_vector<ptr> slots;
+    object_vector<int> code;  // instructions of a TCODE object
+    int native;        // its compiled function (see --compile), or -1
+    // of a TENV: bit (id mod 64) is set for the id of every symbol it binds,
+    // so that searches can skip environments without the name
+    uint64_t names;
+    type_t type;
+    char in_use, young, mark, remembered, region;
+};
+vector<heap_object> objects;
+vector<long long> free_objects, young_objects, remembered_objects;
+// Environments of active calls that no closure has captured. They are freed
+// as soon as their call returns; until then the minor collector scans them
+// like remembered objects.
+vector<long long> frame_region;
+// objects in use, and objects that became old since the last full collection
+long long objects_in_use = 0, objects_aged = 0;
+// Slots of the young objects, of the objects that became old since the last
+// full collection and of the old ones that survived it, so that objects
+// holding many slots bring collections on sooner.
+long long young_slots = 0, slots_aged = 0, slots_live = 0;
 
 struct root_guard {
-    explicit root_guard(ptr &p) { rootl.push_front(&p); }
-    ~root_guard() { rootl.pop_front(); }
+    explicit root_guard(ptr &p) { root_stack.push_back(&p); }
+    ~root_guard() { root_stack.pop_back(); }
+};
+
+// Vectors of values owned by C++ code, such as the bytecode engine's value
+// stack, are registered here as a whole.
+vector<vector<ptr> *> root_vectors;
+
+struct root_vector_guard {
+    explicit root_vector_guard(vector<ptr> &v) { root_vectors.push_back(&v); }
+    ~root_vector_guard() { root_vectors.pop_back(); }
 };
 
 bool effective_cons_p(ptr p) {
-    return p.type == TCONS || p.type == TENV || p.type == TMACRO ||
-           p.type == TPROC;
+    return p.type() >= TPROC && p.type() <= TCONS;
 }
 
+bool object_p(ptr p) { return p.type() >= TENV; }
+
+bool heap_p(ptr p) { return p.type() >= TPROC; }
+
 ptr make_input_port(istream *st) {
-    ptr p;
-    p.type = TIPORT;
-    p.iport = st;
-    return p;
+    istreams.push_back(st);
+    return make_tagged(TIPORT, istreams.size() - 1);
 }
 
 ptr make_output_port(ostream *st) {
-    ptr p;
-    p.type = TOPORT;
-    p.oport = st;
-    return p;
+    ostreams.push_back(st);
+    return make_tagged(TOPORT, ostreams.size() - 1);
 }
 
 ptr read(ptr &);
@@ -119,605 +557,3520 @@ auto iport = make_input_port(&cin);
 auto oport = make_output_port(&cout);
 auto eport = make_output_port(&cerr);
 
-ptr &get_car(ptr p) {
+ptr get_car(ptr p) {
     if (!effective_cons_p(p)) {
         print(p, eport);
         cerr << ": ";
         ERR_EXIT("get-car on non-cons");
     }
-    return car[p.index];
+    return cell_at(p.index()).car;
 }
 
-ptr &get_cdr(ptr p) {
+ptr get_cdr(ptr p) {
     if (!effective_cons_p(p)) {
         print(p, eport);
         cerr << ": ";
         ERR_EXIT("get-cdr on non-cons");
     }
-    return cdr[p.index];
+    return cell_at(p.index()).cdr;
 }
 
-void gc_init() {
-    car.resize(memory_size);
-    cdr.resize(memory_size);
-    mark.resize(memory_size);
-    for (long long i = 0; i < memory_size; i++) freel.push_back(i);
+bool young_p(ptr p) {
+    if (effective_cons_p(p)) return p.index() < nursery_size;
+    return object_p(p) && objects[p.index()].young;
 }
 
-void gc_mark(long long u) {
-    if (mark[u]) return;
-    mark[u] = true;
-    if (car[u].type >= TPROC) gc_mark(car[u].index);
-    if (cdr[u].type >= TPROC) gc_mark(cdr[u].index);
+// Every store into an existing cell or object goes through one of these,
+// so that old cells and objects pointing to young ones are known to the
+// minor collector.
+void gc_write_barrier(long long i, ptr val) {
+    if (i < nursery_size || !young_p(val)) return;
+    auto bit = 1ull << (i & 63);
+    auto &word = remembered_word(i);
+    if (word & bit) return;
+    word |= bit;
+    remembered.push_back(i);
 }
 
-void gc_cycle() {
-    for (auto p : allocl) mark[p] = false;
-    for (auto p : rootl)
-        if (effective_cons_p(*p)) gc_mark(p->index);
-    for (auto it = allocl.begin(); it != allocl.end();) {
-        if (mark[*it]) {
-            it++;
-        } else {
-            freel.push_front(*it);
-            it = allocl.erase(it);
-        }
-    }
+void gc_object_barrier(long long id, ptr val) {
+    auto &o = objects[id];
+    if (o.young || o.remembered || !young_p(val)) return;
+    o.remembered = 1;
+    remembered_objects.push_back(id);
 }
 
-long long gc_alloc() {
-    // gc_cycle();
-    if (freel.empty()) gc_cycle();
-    if (freel.empty()) {
-        for (auto i = memory_size; i < memory_size * 2; i++) freel.push_back(i);
-        memory_size *= 2;
-        car.resize(memory_size);
-        cdr.resize(memory_size);
-        mark.resize(memory_size);
-    }
-    auto p = freel.front();
-    freel.pop_front();
-    allocl.push_back(p);
-    return p;
+void set_car(ptr p, ptr val) {
+    if (!effective_cons_p(p)) ERR_EXIT("set-car on non-cons");
+    gc_write_barrier(p.index(), val);
+    cell_at(p.index()).car = val;
 }
 
-ptr make_number(long double num) {
-    ptr p;
-    p.type = TNUM;
-    p.number = num;
-    return p;
+void set_cdr(ptr p, ptr val) {
+    if (!effective_cons_p(p)) ERR_EXIT("set-cdr on non-cons");
+    gc_write_barrier(p.index(), val);
+    cell_at(p.index()).cdr = val;
 }
 
-ptr make_ptr() { return make_number(0); }
+object_vector<ptr> &object_slots(ptr p) { return objects[p.index()].slots; }
 
-ptr cons(ptr ccar, ptr ccdr, type_t type = TCONS) {
-    ptr p;
-    p.type = type;
-    p.index = gc_alloc();
-    car[p.index] = ccar;
-    cdr[p.index] = ccdr;
-    return p;
+void object_set(ptr p, long long slot, ptr val) {
+    gc_object_barrier(p.index(), val);
+    objects[p.index()].slots[slot] = val;
 }
 
-ptr make_eof() {
-    ptr p;
-    p.type = TEOF;
-    return p;
+void object_push(ptr p, ptr val) {
+    gc_object_barrier(p.index(), val);
+    objects[p.index()].slots.push_back(val);
 }
 
-ptr read_cdr(ptr &port) {
-    if (port.type != TIPORT) ERR_EXIT("Read-cdr: not an input port");
-    int c = port.iport->get();
-    while (isspace(c)) c = port.iport->get();
-    if (c == EOF) ERR_EXIT("Read-cdr: unexpected EOF");
-    if (c == '.') {
-        ptr tmp = read(port);
-        do {
-            c = port.iport->get();
-        } while (isspace(c));
-        if (c != ')')
-            ERR_EXIT("Read-cdr: expected )");
-        else
-            return tmp;
-    } else if (c == ')') {
-        return intern("nil");
-    } else {
-        port.iport->unget();
-        ptr ccar = make_ptr(), ccdr = make_ptr();
-        root_guard carg(ccar);
-        ccar = read(port);
-        root_guard cdrg(ccdr);
-        ccdr = read_cdr(port);
-        return cons(ccar, ccdr);
+// Returns null if the address space is not available.
+void *reserve_pages(size_t bytes) {
+    auto p = mmap(nullptr, bytes, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+// Reserves room for as many segments as allowed, halving the request while
+// it fails, but for at least `need`.
+void reserve_heap(long long need) {
+    const long long segment_bytes =
+        SEGMENT_CELLS * sizeof(cell) + sizeof(segment_bitmaps);
+    long long n = MAX_SEGMENTS;
+    rlimit limit;
+    if (!getrlimit(RLIMIT_AS, &limit) && limit.rlim_cur != RLIM_INFINITY)
+        n = min(n, (long long)(limit.rlim_cur / 2 / segment_bytes));
+    for (n = max(n, need);; n = max(n / 2, need)) {
+        cells = (cell *)reserve_pages(n * SEGMENT_CELLS * sizeof(cell));
+        bitmaps = (segment_bitmaps *)reserve_pages(n * sizeof(segment_bitmaps));
+        if (cells && bitmaps) break;
+        if (cells) munmap(cells, n * SEGMENT_CELLS * sizeof(cell));
+        if (bitmaps) munmap(bitmaps, n * sizeof(segment_bitmaps));
+        if (n == need) ERR_EXIT("Cannot reserve the heap");
     }
+    max_segments = n;
 }
 
-bool delimp(char c) { return isspace(c) || c == '(' || c == ')'; }
+// Makes the reserved pages overlapping [p, p + bytes) accessible.
+void commit_pages(void *p, size_t bytes) {
+    uintptr_t page = sysconf(_SC_PAGESIZE), start = (uintptr_t)p / page * page;
+    if (mprotect((void *)start, (uintptr_t)p + bytes - start,
+                 PROT_READ | PROT_WRITE))
+        ERR_EXIT("Cannot grow the heap");
+}
 
-bool eq(ptr p, ptr q) {
-    if (p.type == TCONS || p.type == TENV || p.type == TMACRO ||
-        p.type == TPROC) {
-        return q.type == p.type && p.index == q.index;
-    } else if (p.type == TEOF) {
-        return q.type == p.type;
-    } else if (p.type == TIPORT) {
-        return q.type == p.type && p.iport == q.iport;
-    } else if (p.type == TOPORT) {
-        return q.type == p.type && p.oport == q.oport;
-    } else if (p.type == TPRIM) {
-        return q.type == p.type && p.index == q.index;
-    } else if (p.type == TNUM) {
-        return q.type == p.type && p.number == q.number;
-    } else if (p.type == TSYM) {
-        return q.type == p.type && p.symbol == q.symbol;
-    } else if (p.type == TUNBOUND) {
-        return q.type == p.type;
-    } else {
-        ERR_EXIT("Eq: unexpected object type");
+void gc_resize(long long size) {
+    memory_size = size;
+    if (!cells) reserve_heap((memory_size + SEGMENT_CELLS - 1) >> SEGMENT_BITS);
+    // new segments are zero-filled, so their bitmaps start out clear
+    for (; segment_count << SEGMENT_BITS < memory_size; segment_count++) {
+        if (segment_count == max_segments) ERR_EXIT("Heap exhausted");
+        commit_pages(&cells[segment_count << SEGMENT_BITS],
+                     SEGMENT_CELLS * sizeof(cell));
+        commit_pages(&bitmaps[segment_count], sizeof(segment_bitmaps));
     }
 }
 
-ptr read(ptr &port) {
-read_start:
-    if (port.type != TIPORT) ERR_EXIT("Read: not an input port");
-    int c = port.iport->get();
-    while (isspace(c)) c = port.iport->get();
-    if (c == EOF) return make_eof();
-
-    if (c == '(') return read_cdr(port);
-    if (c == '#') {
-        c = port.iport->get();
-        if (c == '\\') {
-            c = port.iport->get();
-            return make_number(c);
-        } else if (c == '<') {
-            ERR_EXIT("Read: unreadable object");
-        }
-        ERR_EXIT("Read: unexpected object");
-    } else if (c == '.') {
-        ERR_EXIT("Read: unexpected dot");
-    } else if (c == ';') {
-        while (c != '\n' && c != EOF) {
-            c = port.iport->get();
-        }
-        port.iport->unget();
-        goto read_start;
-    } else if (c == '\'') {
-        ptr quote = intern("quote"), text = make_ptr(), ccdr = make_ptr();
-        root_guard g1(quote), g2(text), g3(ccdr);
-        text = read(port);
-        ccdr = cons(text, intern("nil"));
-        return cons(quote, ccdr);
-    } else {
-        port.iport->unget();
-        string s;
-        while (!delimp(c = port.iport->get())) {
-            s += c;
-        }
-        port.iport->unget();
-        char *e;
-        long double val = strtold(s.c_str(), &e);
-        if (*e != '\0' || errno) return intern(s.c_str());
-        return make_number(val);
+// Arguments are evaluated onto value_stack by both engines. The bytecode
+// engine also keeps its temporaries there and the code object and
+// environment of each active call in vm_frame_values.
+vector<ptr> value_stack, vm_frame_values;
+
+// Values of global variables, indexed by symbol id. The global environment
+// object itself holds no bindings and only ends the chain of frames.
+vector<ptr> global_values;
+
+void gc_init() {
+    bump = nursery_size;
+    gc_resize(nursery_size + heap_size);
+    root_stack.reserve(1 << 16);
+    root_vectors.push_back(&value_stack);
+    root_vectors.push_back(&vm_frame_values);
+    root_vectors.push_back(&global_values);
+}
+
+bool gc_marked(long long u) { return mark_word(u) >> (u & 63) & 1; }
+
+// Sets the mark of the cell or object p and returns whether it was clear
+// before. The atomic version is used when several threads mark at once.
+bool gc_try_mark(ptr p) {
+    auto u = p.index();
+    if (object_p(p)) {
+        if (objects[u].mark) return false;
+        objects[u].mark = 1;
+        return true;
     }
+    auto bit = 1ull << (u & 63);
+    auto &word = mark_word(u);
+    if (word & bit) return false;
+    word |= bit;
+    return true;
 }
 
-void print_cdr(const ptr &p, ptr &port) {
-    print(car[p.index], port);
-    if (cdr[p.index].type == TCONS) {
-        (*port.oport) << " ";
-        print_cdr(cdr[p.index], port);
-    } else {
-        if (eq(cdr[p.index], intern("nil"))) {
-            (*port.oport) << ")";
-            return;
-        }
-        (*port.oport) << " . ";
-        print(cdr[p.index], port);
-        (*port.oport) << ")";
-    }
-}
-
-void print(const ptr &p, ptr &port) {
-    if (port.type != TOPORT) ERR_EXIT("Print: not an output port");
-    if (p.type == TCONS) {
-        (*port.oport) << "(";
-        print_cdr(p, port);
-    } else if (p.type == TENV) {
-        (*port.oport) << "#<environment>";
-    } else if (p.type == TEOF) {
-        (*port.oport) << "#eof";
-    } else if (p.type == TIPORT) {
-        (*port.oport) << "#<input port>";
-    } else if (p.type == TOPORT) {
-        (*port.oport) << "#<output port>";
-    } else if (p.type == TMACRO) {
-        (*port.oport) << "#<macro>";
-    } else if (p.type == TPROC) {
-        (*port.oport) << "#<procedure>";
-    } else if (p.type == TPRIM) {
-        (*port.oport) << "#<primitive>";
-    } else if (p.type == TNUM) {
-        (*port.oport) << p.number;
-    } else if (p.type == TSYM) {
-        string s;
-        for (auto u = p.symbol; u >= 0; u = obarray.nodes[u].father) {
-            if (obarray.nodes[u].path) s += obarray.nodes[u].path;
-        }
-        reverse(s.begin(), s.end());
-        (*port.oport) << s;
-    } else if (p.type == TUNBOUND) {
-        (*port.oport) << "#<unbound>";
+bool gc_try_mark_atomic(ptr p) {
+    auto u = p.index();
+    if (object_p(p))
+        return !__atomic_exchange_n(&objects[u].mark, 1, __ATOMIC_RELAXED);
+    auto bit = 1ull << (u & 63);
+    auto &word = mark_word(u);
+    if (__atomic_load_n(&word, __ATOMIC_RELAXED) & bit) return false;
+    return !(__atomic_fetch_or(&word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+// Calls f on every value held by the cell or object p.
+template <class F>
+void gc_children(ptr p, F f) {
+    auto u = p.index();
+    if (object_p(p)) {
+        for (auto q : objects[u].slots) f(q);
     } else {
-        ERR_EXIT("Print: unexpected object type: %d", p.type);
+        auto &c = cell_at(u);
+        f(c.car);
+        f(c.cdr);
     }
 }
 
-ptr make_unbound() {
-    ptr p;
-    p.type = TUNBOUND;
-    return p;
+// Calls f on a reference to every root.
+template <class F>
+void gc_each_root(F f) {
+    for (auto p : root_stack) f(*p);
+    for (auto v : root_vectors)
+        for (auto &p : *v) f(p);
 }
 
-ptr lookup(ptr env, ptr sym) {
-lookup_start:
-    root_guard g1(env), g2(sym);
-    if (eq(env, intern("nil"))) {
-        return make_unbound();
-    }
-    if (env.type != TENV) ERR_EXIT("Lookup: not an environment");
-    if (sym.type != TSYM) ERR_EXIT("Lookup: not a symbol");
-    auto p = get_car(env);
-    for (auto i = p; !eq(i, intern("nil")); i = get_cdr(i)) {
-        auto c = get_car(i);
-        if (eq(get_car(c), sym))
-            return eq(get_cdr(c), make_unbound()) ? make_unbound() : c;
+int gc_threads = 1;
+// heaps with fewer used cells than this are always marked on one thread
+long long parallel_mark_min = 1 << 18;
+
+vector<ptr> mark_stack;
+
+void gc_mark(ptr p) {
+    if (!heap_p(p) || !gc_try_mark(p)) return;
+    mark_stack.push_back(p);
+    while (!mark_stack.empty()) {
+        p = mark_stack.back();
+        mark_stack.pop_back();
+        gc_children(p, [](ptr q) {
+            if (heap_p(q) && gc_try_mark(q)) mark_stack.push_back(q);
+        });
     }
-    // try parent
-    env = get_cdr(env);
-    goto lookup_start;
 }
 
-void print_mem() {
-    for (long long i = 0; i < memory_size; i++) {
-        cerr << i << ": ";
-        cerr << car[i].type << "-";
-        if (effective_cons_p(car[i]))
-            cerr << car[i].index;
-        else if (car[i].type == TNUM)
-            cerr << car[i].number;
-        else if (car[i].type == TSYM)
-            print(car[i], eport);
-        cerr << " ";
-        cerr << cdr[i].type << "-";
-        if (effective_cons_p(cdr[i]))
-            cerr << cdr[i].index;
-        else if (cdr[i].type == TNUM)
-            cerr << cdr[i].number;
-        else if (cdr[i].type == TSYM)
-            print(cdr[i], eport);
-        cerr << endl;
+// Parallel marking: each worker drains a private stack and publishes part
+// of it to a lock-protected shared stack when others are idle; workers
+// that run dry take their own shared work first and then steal half of
+// another worker's.
+struct mark_worker {
+    vector<ptr> local;
+    mutex m;
+    vector<ptr> shared;
+};
+
+void gc_mark_worker(vector<mark_worker> &workers, int self,
+                    atomic<int> &idle) {
+    auto &w = workers[self];
+    int n = workers.size();
+    while (true) {
+        while (!w.local.empty()) {
+            auto p = w.local.back();
+            w.local.pop_back();
+            gc_children(p, [&](ptr q) {
+                if (heap_p(q) && gc_try_mark_atomic(q)) w.local.push_back(q);
+            });
+            if (w.local.size() > 256 && idle.load(memory_order_relaxed)) {
+                lock_guard<mutex> l(w.m);
+                auto half = w.local.begin() + w.local.size() / 2;
+                w.shared.insert(w.shared.end(), w.local.begin(), half);
+                w.local.erase(w.local.begin(), half);
+            }
+        }
+        {
+            lock_guard<mutex> l(w.m);
+            swap(w.local, w.shared);
+        }
+        if (!w.local.empty()) continue;
+        bool stolen = false, waiting = false;
+        while (!stolen) {
+            for (int i = 1; i < n && !stolen; i++) {
+                auto &v = workers[(self + i) % n];
+                lock_guard<mutex> l(v.m);
+                if (v.shared.empty()) continue;
+                auto half = v.shared.begin() + (v.shared.size() + 1) / 2;
+                w.local.assign(v.shared.begin(), half);
+                v.shared.erase(v.shared.begin(), half);
+                stolen = true;
+            }
+            if (stolen) break;
+            if (!waiting) {
+                waiting = true;
+                if (++idle == n) return;
+            } else if (idle.load() == n) {
+                return;
+            }
+            this_thread::yield();
+        }
+        if (waiting) idle--;
     }
 }
 
-ptr make_procedure(ptr formals, ptr body, ptr env, type_t type = TPROC) {
-    ptr p = make_ptr();
-    root_guard g(p);
-    p = cons(formals, body);
-    return cons(env, p, type);
+void gc_mark_roots() {
+    int n = bump >= parallel_mark_min ? gc_threads : 1;
+    if (n <= 1) {
+        gc_each_root([](ptr &p) { gc_mark(p); });
+        return;
+    }
+    vector<mark_worker> workers(n);
+    int next = 0;
+    gc_each_root([&](ptr &p) {
+        if (heap_p(p) && gc_try_mark(p)) workers[next++ % n].local.push_back(p);
+    });
+    atomic<int> idle(0);
+    vector<thread> threads;
+    for (int i = 1; i < n; i++)
+        threads.emplace_back(gc_mark_worker, ref(workers), i, ref(idle));
+    gc_mark_worker(workers, 0, idle);
+    for (auto &t : threads) t.join();
 }
 
-ptr procedure_formals(ptr f) { return get_car(get_cdr(f)); }
-ptr procedure_body(ptr f) { return get_cdr(get_cdr(f)); }
-ptr procedure_env(ptr f) { return get_car(f); }
+void gc_free_object(long long id) {
+    auto &o = objects[id];
+    o.slots.clear();
+    o.code.clear();
+    o.in_use = o.young = o.mark = o.remembered = o.region = 0;
+    free_objects.push_back(id);
+    objects_in_use--;
+    gc_stats.objects_freed++;
+}
 
-ptr eval(ptr expr, ptr env);
+// Expansions of macro calls made by eval, keyed by the cell of the call, so
+// that each call site is expanded once without changing the call. An entry
+// is used while the operator still yields the same macro, and it is kept
+// only as long as the call is live.
+struct macro_expansion {
+    ptr macro, form;
+};
+unordered_map<long long, macro_expansion> expansions;
+// calls expanded since the last minor collection
+vector<long long> young_expansions;
 
-ptr evlis(ptr args, ptr env) {
-    if (eq(args, intern("nil"))) return intern("nil");
-    ptr p = make_ptr(), q = make_ptr();
-    root_guard g1(p), g2(q);
-    p = eval(get_car(args), env);
-    q = evlis(get_cdr(args), env);
-    return cons(p, q);
+bool gc_reached(ptr p) {
+    return object_p(p) ? objects[p.index()].mark : gc_marked(p.index());
 }
 
-ptr make_frame(ptr formals, ptr args) {
-    root_guard g1(formals), g2(args);
-    if (eq(formals, intern("nil")) && (!eq(args, intern("nil"))))
-        ERR_EXIT("Make-frame: too many arguments");
-    if (eq(formals, intern("nil"))) return intern("nil");
-    if (formals.type == TSYM) {
-        auto p = make_ptr();
-        root_guard g(p);
-        p = cons(formals, args);
-        return cons(p, intern("nil"));
-    }
-    if (formals.type != TCONS) ERR_EXIT("Make-frame: expected cons");
-    if (get_car(formals).type != TSYM)
-        ERR_EXIT("Make-frame: non-symbol on car of formals");
-    auto p = make_ptr(), q = make_ptr();
-    root_guard g3(p), g4(q);
-    p = make_frame(get_cdr(formals), get_cdr(args));
-    q = cons(get_car(formals), get_car(args));
-    return cons(q, p);
-}
-
-ptr cons_prim(ptr args) { return cons(get_car(args), get_car(get_cdr(args))); }
-ptr consp_prim(ptr args) {
-    return get_car(args).type == TCONS ? intern("t") : intern("nil");
-}
-ptr plus_prim(ptr args) {
-    long double sum = 0;
-    while (!eq(args, intern("nil"))) {
-        auto c = get_car(args);
-        if (c.type != TNUM) ERR_EXIT("+: not a number");
-        sum += c.number;
-        args = get_cdr(args);
-    }
-    return make_number(sum);
-}
-ptr times_prim(ptr args) {
-    long double prod = 1;
-    while (!eq(args, intern("nil"))) {
-        auto c = get_car(args);
-        if (c.type != TNUM) ERR_EXIT("*: not a number");
-        prod *= c.number;
-        args = get_cdr(args);
+void gc_cycle() {
+    gc_stats.major_collections++;
+    gc_pause_timer timer{gc_stats.major_pause_total, gc_stats.major_pause_max,
+                         gc_stats.major_pauses};
+    auto free_before = free_count;
+    for (long long s = 0; s < segment_count; s++)
+        memset(bitmaps[s].mark_bits, 0, sizeof bitmaps[s].mark_bits);
+    for (auto &o : objects) o.mark = 0;
+    gc_mark_roots();
+    for (auto id : frame_region) gc_mark(make_tagged(TENV, id));
+    // young cells and objects reached through the remembered sets are live
+    // as well
+    for (auto i : remembered) {
+        gc_mark(cell_at(i).car);
+        gc_mark(cell_at(i).cdr);
     }
-    return make_number(prod);
-}
-ptr minus_prim(ptr args) {
-    if (get_car(args).type != TNUM) ERR_EXIT("-: expected number");
-    long double diff = get_car(args).number;
-    args = get_cdr(args);
-    bool flag = false;
-    while (!eq(args, intern("nil"))) {
-        auto c = get_car(args);
-        if (c.type != TNUM) ERR_EXIT("-: not a number");
-        diff -= c.number;
-        args = get_cdr(args);
-        flag = true;
-    }
-    if (!flag) diff *= -1;
-    return make_number(diff);
-}
-ptr divide_prim(ptr args) {
-    if (get_car(args).type != TNUM) ERR_EXIT("/: expected number");
-    long double quotient = get_car(args).number;
-    args = get_cdr(args);
-    bool flag = false;
-    while (!eq(args, intern("nil"))) {
-        auto c = get_car(args);
-        if (c.type != TNUM) ERR_EXIT("/: not a number");
-        quotient /= c.number;
-        args = get_cdr(args);
-        flag = true;
-    }
-    if (!flag) quotient = 1 / quotient;
-    return make_number(quotient);
-}
-ptr equal_prim(ptr args) {
-    if (!eq(args, intern("nil"))) {
-        for (auto p = args; !eq(get_cdr(p), intern("nil")); p = get_cdr(p)) {
-            if (get_car(p).type != TNUM || get_car(get_cdr(p)).type != TNUM)
-                ERR_EXIT("=: expected number");
-            if (abs(get_car(p).number - get_car(get_cdr(p)).number) > 0) {
-                return intern("nil");
+    for (auto id : remembered_objects)
+        for (auto q : objects[id].slots) gc_mark(q);
+    // marking what one expansion holds may reach the call of another; young
+    // calls are left for the minor collector to judge
+    for (bool again = true; again;) {
+        again = false;
+        for (auto &kv : expansions) {
+            if (kv.first >= nursery_size && !gc_marked(kv.first)) continue;
+            auto &e = kv.second;
+            for (auto q : {e.macro, e.form}) {
+                if (!heap_p(q) || gc_reached(q)) continue;
+                gc_mark(q);
+                again = true;
             }
         }
     }
-    return intern("t");
-}
-ptr car_prim(ptr args) { return get_car(get_car(args)); }
-ptr cdr_prim(ptr args) { return get_cdr(get_car(args)); }
-ptr null_prim(ptr args) {
-    return eq(get_car(args), intern("nil")) ? intern("t") : intern("nil");
-}
-ptr eq_prim(ptr args) {
-    return eq(get_car(args), get_car(get_cdr(args))) ? intern("t")
-                                                     : intern("nil");
+    for (auto it = expansions.begin(); it != expansions.end();)
+        it = it->first >= nursery_size && !gc_marked(it->first)
+                 ? expansions.erase(it)
+                 : next(it);
+    free_head = -1;
+    free_count = 0;
+    for (auto i = bump - 1; i >= nursery_size; i--) {
+        if (gc_marked(i)) continue;
+        cell_at(i).car.bits = free_head;
+        free_head = i;
+        free_count++;
+    }
+    gc_stats.cells_freed += free_count - free_before;
+    if (profiling)
+        prof.forget([](long long i) {
+            return i >= nursery_size && !gc_marked(i);
+        });
+    slots_live = 0;
+    for (long long id = 0; id < (long long)objects.size(); id++) {
+        auto &o = objects[id];
+        if (!o.in_use || o.young) continue;
+        if (!o.mark)
+            gc_free_object(id);
+        else
+            slots_live += o.slots.size();
+    }
+    // young objects are left for the minor collector, which uses their
+    // marks to tell which ones it has already scanned
+    for (auto id : young_objects) objects[id].mark = 0;
+    auto live = remove_if(remembered.begin(), remembered.end(), [](auto i) {
+        if (gc_marked(i)) return false;
+        remembered_word(i) &= ~(1ull << (i & 63));
+        return true;
+    });
+    remembered.erase(live, remembered.end());
+    auto live_objects = remove_if(
+        remembered_objects.begin(), remembered_objects.end(),
+        [](auto id) { return !objects[id].in_use; });
+    remembered_objects.erase(live_objects, remembered_objects.end());
+    objects_aged = slots_aged = 0;
 }
-ptr unbound_prim(ptr args) { return make_unbound(); }
-ptr gensym_prim(ptr args) {
-    static int counter = 0;
-    counter++;
-    string s = "gensym-" + to_string(counter);
-    return intern(s.c_str());
+
+long long gc_old_available() { return free_count + (memory_size - bump); }
+
+// Makes sure the old space has room for n more cells, collecting it first
+// and growing it when more than half of it is still live afterwards.
+void gc_reserve(long long n) {
+    if (gc_old_available() >= n) return;
+    gc_cycle();
+    auto old_size = memory_size - nursery_size;
+    if (free_count * 2 < old_size || gc_old_available() < n) {
+        gc_stats.heap_growths++;
+        // growth stops short of the reservation if it must
+        auto size = nursery_size + (long long)(old_size * growth_factor);
+        gc_resize(
+            max(memory_size + n, min(size, max_segments << SEGMENT_BITS)));
+    }
 }
-ptr symbolp_prim(ptr args) {
-    return get_car(args).type == TSYM ? intern("t") : intern("nil");
+
+long long gc_alloc_old() {
+    if (free_head >= 0) {
+        auto p = free_head;
+        free_head = cell_at(p).car.bits;
+        free_count--;
+        return p;
+    }
+    return bump++;
 }
-ptr display_prim(ptr args) {
-    print(get_car(args), oport);
-    return intern("display");
+
+long long gc_alloc() {
+    gc_reserve(1);
+    return gc_alloc_old();
 }
-ptr newline_prim(ptr args) {
-    (*oport.oport) << endl;
-    return intern("newline");
+
+vector<long long> promoted, scanned_objects;
+
+// Hash tables place keys by their bits, which change when a young key is
+// promoted, so the minor collector rehashes the tables whose keys moved.
+void table_rehash(long long id, size_t capacity);
+vector<long long> moved_tables;
+
+// Copies a nursery cell into the old space, leaving a forwarding pointer
+// behind, and returns its new location. Young objects stay where they are
+// and are queued to have their slots scanned.
+ptr gc_evacuate(ptr p) {
+    if (!young_p(p)) return p;
+    auto i = p.index();
+    if (object_p(p)) {
+        if (!objects[i].mark) {
+            objects[i].mark = 1;
+            scanned_objects.push_back(i);
+        }
+        return p;
+    }
+    auto &from = cell_at(i);
+    if (from.car.type() == TFORWARD)
+        return make_tagged(p.type(), from.car.index());
+    auto j = gc_alloc_old();
+    cell_at(j) = from;
+    from.car = make_tagged(TFORWARD, j);
+    promoted.push_back(j);
+    if (profiling && (p.type() == TPROC || p.type() == TMACRO))
+        prof.moved(i, j);
+    return make_tagged(p.type(), j);
 }
 
-vector<function<ptr(ptr)>> primitives{
-    cons_prim,   consp_prim,   car_prim,     cdr_prim,
-    plus_prim,   times_prim,   minus_prim,   divide_prim,
-    equal_prim,  null_prim,    eq_prim,      unbound_prim,
-    gensym_prim, symbolp_prim, display_prim, newline_prim};
-vector<string> primitive_names{"cons",   "consp",   "car",     "cdr",
-                               "+",      "*",       "-",       "/",
-                               "=",      "null",    "eq",      "unbound",
-                               "gensym", "symbolp", "display", "newline"};
+// Evacuates the slots of an object, queueing a hash table to be rehashed if
+// one of its keys moved.
+void gc_scan_object(long long id) {
+    auto &o = objects[id];
+    bool moved = false;
+    for (size_t i = 0; i < o.slots.size(); i++) {
+        auto q = gc_evacuate(o.slots[i]);
+        // keys are in the even slots from 2 on
+        if (o.type == THASH && i >= 2 && i % 2 == 0 &&
+            q.bits != o.slots[i].bits)
+            moved = true;
+        o.slots[i] = q;
+    }
+    if (moved) moved_tables.push_back(id);
+}
 
-ptr eval(ptr expr, ptr env) {
-eval_start:
-    // print_mem();
-    // print(expr, eport);
-    // cerr << " ";
-    // for (auto p = env; !eq(p, intern("nil")); p = get_cdr(p)) {
-    //     print(get_car(p), eport);
-    //     cerr << " ";
-    // }
-    // cerr << endl << endl;
-    root_guard g1(expr), g2(env);
-    auto orig_env = env;
-    root_guard g3(orig_env);
-    if (expr.type != TCONS) {
-        if (expr.type == TSYM) {
-            if (eq(expr, intern("nil")) || eq(expr, intern("t"))) return expr;
-            auto p = lookup(env, expr);
-            if (eq(p, make_unbound())) {
-                print(expr, eport);
-                cerr << ": ";
-                ERR_EXIT("eval: unbound variable");
+// Cheney-style minor collection: everything reachable from the roots and
+// the remembered sets is promoted, then the promoted cells and reached
+// objects are scanned in turn until no young pointers remain. Young
+// objects that were not reached are freed.
+void gc_minor() {
+    gc_stats.minor_collections++;
+    gc_pause_timer timer{gc_stats.minor_pause_total, gc_stats.minor_pause_max,
+                         gc_stats.minor_pauses};
+    gc_reserve(nursery_top);
+    gc_each_root([](ptr &p) { p = gc_evacuate(p); });
+    for (auto i : remembered) {
+        remembered_word(i) &= ~(1ull << (i & 63));
+        auto &c = cell_at(i);
+        c.car = gc_evacuate(c.car);
+        c.cdr = gc_evacuate(c.cdr);
+    }
+    remembered.clear();
+    for (auto id : remembered_objects) {
+        objects[id].remembered = 0;
+        gc_scan_object(id);
+    }
+    remembered_objects.clear();
+    for (auto id : frame_region) gc_scan_object(id);
+    size_t k = 0, l = 0;
+    auto scan = [&] {
+        while (k < promoted.size() || l < scanned_objects.size()) {
+            for (; k < promoted.size(); k++) {
+                auto &c = cell_at(promoted[k]);
+                c.car = gc_evacuate(c.car);
+                c.cdr = gc_evacuate(c.cdr);
             }
-            return get_cdr(p);
+            for (; l < scanned_objects.size(); l++)
+                gc_scan_object(scanned_objects[l]);
         }
-        return expr;
+    };
+    scan();
+    // the expansions of calls that survived move with them; evacuating one
+    // may promote the call of another, so this runs until nothing changes
+    for (bool again = true; again;) {
+        again = false;
+        for (auto &i : young_expansions) {
+            if (i < 0) continue;
+            auto it = expansions.find(i);
+            if (it == expansions.end()) {
+                i = -1;
+                continue;
+            }
+            auto to = i;
+            if (i < nursery_size) {
+                auto car = cell_at(i).car;
+                if (car.type() != TFORWARD) continue;
+                to = car.index();
+            }
+            auto e = it->second;
+            expansions.erase(it);
+            e.macro = gc_evacuate(e.macro);
+            e.form = gc_evacuate(e.form);
+            expansions[to] = e;
+            i = -1;
+            again = true;
+        }
+        scan();
     }
-    if (eq(get_car(expr), intern("quote"))) return get_car(get_cdr(expr));
-    if (eq(get_car(expr), intern("if"))) {
-        auto p = make_ptr();
-        root_guard g(p);
-        p = eval(get_car(get_cdr(expr)), env);
-        if (eq(p, intern("nil"))) {
-            // alternative or nil
-            if (eq(get_cdr(get_cdr(get_cdr(expr))), intern("nil")))
-                return intern("nil");
-            expr = get_car(get_cdr(get_cdr(get_cdr(expr))));
-            goto eval_start;  // tail call to eval
+    for (auto i : young_expansions)
+        if (i >= 0) expansions.erase(i);
+    young_expansions.clear();
+    for (auto id : moved_tables)
+        table_rehash(id, (objects[id].slots.size() - 2) / 2);
+    moved_tables.clear();
+    gc_stats.cells_promoted += promoted.size();
+    promoted.clear();
+    scanned_objects.clear();
+    for (auto id : young_objects) {
+        auto &o = objects[id];
+        if (!o.mark) {
+            gc_free_object(id);
         } else {
-            expr = get_car(get_cdr(get_cdr(expr)));
-            goto eval_start;
+            o.young = o.mark = 0;
+            objects_aged++;
+            slots_aged += o.slots.size();
         }
     }
-    if (eq(get_car(expr), intern("set!"))) {
-        auto p = make_ptr();
-        root_guard g(p);
-        p = lookup(env, get_car(get_cdr(expr)));
-        auto val = make_ptr();
-        root_guard gp(val);
-        val = eval(get_car(get_cdr(get_cdr(expr))), env);
-        if (eq(p, make_unbound())) {
-            auto pair = make_ptr(), lst = make_ptr();
-            root_guard g1(pair), g2(lst);
-            pair = cons(get_car(get_cdr(expr)), val);
-            lst = cons(pair, get_car(env));
-            get_car(env) = lst;
-        }
-        p = lookup(env, get_car(get_cdr(expr)));
-        get_cdr(p) = val;
-        return get_car(get_cdr(expr));
-    }
-    if (eq(get_car(expr), intern("lambda"))) {
-        return make_procedure(get_car(get_cdr(expr)), get_cdr(get_cdr(expr)),
-                              env, TPROC);
+    young_objects.clear();
+    young_slots = 0;
+    nursery_top = 0;
+    if (profiling) prof.forget([](long long i) { return i < nursery_size; });
+}
+
+// Allocates an object with n slots set to `fill`, in the frame region if
+// `region` is set. This may collect, so the caller must keep its values
+// rooted.
+ptr make_object(type_t type, size_t n, ptr fill, bool region = false) {
+    if (nursery_size) {
+        // a slot is half a cell, so the slots may take as much room as the
+        // nursery does
+        if ((long long)young_objects.size() >= max(1LL, nursery_size / 4) ||
+            young_slots >= 2 * nursery_size) {
+            root_guard g(fill);
+            gc_minor();
+        }
     }
-    if (eq(get_car(expr), intern("syntax"))) {
-        return make_procedure(get_car(get_cdr(expr)), get_cdr(get_cdr(expr)),
-                              env, TMACRO);
+    if (objects_aged >= max(1024LL, objects_in_use) ||
+        slots_aged >= max(1LL << 16, slots_live)) {
+        root_guard g(fill);
+        gc_cycle();
     }
-    auto p = make_ptr(), args = make_ptr();
-    root_guard gg1(p), gg2(args);
-    p = eval(get_car(expr), env);
-    if (p.type == TPROC) {
-        args = evlis(get_cdr(expr), env);
-        // apply
-        auto body = make_ptr(), frame = make_ptr(), newenv = make_ptr();
-        root_guard g1(body), g2(frame), g3(newenv);
-        body = procedure_body(p);
-        frame = make_frame(procedure_formals(p), args);
-        newenv = cons(frame, procedure_env(p), TENV);
-        if (eq(body, intern("nil"))) return intern("nil");
-        while (!eq(get_cdr(body), intern("nil"))) {
-            eval(get_car(body), newenv);
-            body = get_cdr(body);
+    long long id;
+    if (free_objects.empty()) {
+        id = objects.size();
+        objects.emplace_back();
+    } else {
+        id = free_objects.back();
+        free_objects.pop_back();
+    }
+    auto &o = objects[id];
+    o.slots.assign(n, fill);
+    o.type = type;
+    o.native = -1;
+    o.names = 0;
+    o.in_use = 1;
+    o.young = nursery_size > 0 && !region;
+    o.mark = 0;
+    // region objects are always scanned by minor collections, so the write
+    // barrier can skip them
+    o.remembered = o.region = region;
+    if (region) {
+        frame_region.push_back(id);
+    } else if (o.young) {
+        young_objects.push_back(id);
+        young_slots += n;
+    } else {
+        objects_aged++;
+        slots_aged += n;
+    }
+    objects_in_use++;
+    gc_stats.objects_allocated++;
+    return make_tagged(type, id);
+}
+
+void region_remove(long long id) {
+    for (auto i = frame_region.size(); i-- > 0;) {
+        if (frame_region[i] == id) {
+            frame_region.erase(frame_region.begin() + i);
+            return;
         }
-        // special handling for last clause in lambda
-        expr = get_car(body);
-        env = newenv;
-        goto eval_start;
-    } else if (p.type == TPRIM) {
-        args = evlis(get_cdr(expr), env);
-        // TODO: special handling for eval and apply that makes the
-        //       interpreter properly tail recursive
-        // apply
-        auto r = make_ptr();
-        root_guard g(r);
-        r = primitives[p.index](args);
-        return r;
-    } else if (p.type == TMACRO) {
-        args = get_cdr(expr);
-        // apply and eval
-        auto body = make_ptr(), frame = make_ptr(), newenv = make_ptr();
-        root_guard g1(body), g2(frame), g3(newenv);
-        body = procedure_body(p);
-        frame = make_frame(procedure_formals(p), args);
-        newenv = cons(frame, procedure_env(p), TENV);
-        if (eq(body, intern("nil"))) return intern("nil");
-        while (!eq(get_cdr(body), intern("nil"))) {
-            eval(get_car(body), newenv);
-            body = get_cdr(body);
+    }
+}
+
+// Moves a captured environment and its region ancestors out of the region.
+// They become young objects, so a closure that is soon dropped takes its
+// frames with it at the next minor collection.
+void capture_frames(ptr env) {
+    for (; env.type() == TENV && objects[env.index()].region;
+         env = objects[env.index()].slots[0]) {
+        auto id = env.index();
+        auto &o = objects[id];
+        region_remove(id);
+        o.region = o.remembered = 0;
+        if (nursery_size) {
+            o.young = 1;
+            young_objects.push_back(id);
+            young_slots += o.slots.size();
+        } else {
+            objects_aged++;
+            slots_aged += o.slots.size();
         }
-        expr = get_car(body);
-        env = newenv;
-        expr = eval(expr, env);
-        env = orig_env;
-        goto eval_start;
     }
-    ERR_EXIT("Eval: unknown expression type");
 }
 
-ptr make_primitive(long long index) {
+// Frees the environment of a call that has returned, unless a closure has
+// captured it or it was never in the region.
+void release_frame(ptr env) {
+    if (env.type() != TENV || !objects[env.index()].region) return;
+    region_remove(env.index());
+    gc_free_object(env.index());
+    gc_stats.frames_released++;
+}
+
+ptr make_number(double num) {
     ptr p;
-    p.type = TPRIM;
-    p.index = index;
+    // every NaN is stored as the positive quiet NaN so it cannot be
+    // mistaken for a boxed value
+    if (num != num)
+        p.bits = 0x7ff8000000000000ull;
+    else
+        memcpy(&p.bits, &num, sizeof num);
     return p;
 }
 
-ptr initial_environment() { return cons(intern("nil"), intern("nil"), TENV); }
+// Integers that fit in the payload are stored as fixnums; results that
+// do not fit become floats.
+const long long FIXNUM_MAX = (1ll << (TAG_SHIFT - 1)) - 1,
+                FIXNUM_MIN = -(1ll << (TAG_SHIFT - 1));
 
-void populate_primitives(ptr &env) {
-    if (primitives.size() != primitive_names.size())
-        ERR_EXIT("Invalid primitive table");
-    for (int i = 0; i < (int)primitives.size(); i++) {
-        auto pair = make_ptr(), lst = make_ptr();
-        root_guard g1(pair), g2(lst);
-        pair = cons(intern(primitive_names[i].c_str()), make_primitive(i));
-        lst = cons(pair, get_car(env));
-        get_car(env) = lst;
-    }
+ptr make_fixnum(long long n) { return make_tagged(TFIX, n); }
+
+ptr make_integer(long long n) {
+    if (n < FIXNUM_MIN || n > FIXNUM_MAX) return make_number(n);
+    return make_fixnum(n);
 }
 
-int main(int argc, char **argv) {
-    gc_init();
-    ptr env = make_ptr();
+bool number_p(ptr p) { return p.type() == TNUM || p.type() == TFIX; }
+
+double to_double(ptr p) {
+    return p.type() == TFIX ? p.fixnum() : p.number();
+}
+
+ptr make_ptr() { return make_number(0); }
+
+ptr cons(ptr ccar, ptr ccdr, type_t type = TCONS) {
+    gc_stats.cells_allocated++;
+    long long i;
+    if (nursery_top < nursery_size) {
+        i = nursery_top++;
+    } else {
+        root_guard g1(ccar), g2(ccdr);
+        if (nursery_size) {
+            gc_minor();
+            i = nursery_top++;
+        } else {
+            i = gc_alloc();
+        }
+    }
+    cell_at(i) = {ccar, ccdr};
+    return make_tagged(type, i);
+}
+
+ptr make_eof() { return make_tagged(TEOF, 0); }
+
+bool delimp(char c) { return isspace(c) || c == '(' || c == ')'; }
+
+bool eq(ptr p, ptr q) { return p.bits == q.bits; }
+
+// Both readers split their input into tokens, which read_datum assembles
+// into data. Atoms come with their value.
+enum token_kind { TOK_OPEN, TOK_CLOSE, TOK_DOT, TOK_QUOTE, TOK_ATOM, TOK_END };
+struct token {
+    token_kind kind;
+    ptr value;
+};
+
+// Characters are classified by table when scanning atoms.
+enum : unsigned char { C_SPACE = 1, C_DELIM = 2, C_NUMBER = 4 };
+
+const array<unsigned char, 256> char_class = [] {
+    array<unsigned char, 256> t{};
+    for (int c = 0; c < 256; c++) {
+        if (isspace(c)) t[c] |= C_SPACE | C_DELIM;
+        // characters that may start something strtod accepts
+        if (isdigit(c) || (c && strchr("+-.iInN", c))) t[c] |= C_NUMBER;
+    }
+    t['('] |= C_DELIM;
+    t[')'] |= C_DELIM;
+    return t;
+}();
+
+// Returns the number or symbol written as the n characters at s.
+ptr parse_atom(const char *s, size_t n) {
+    if (!n || !(char_class[(unsigned char)*s] & C_NUMBER)) return intern(s, n);
+    // fast path for decimal integers
+    size_t i = *s == '-' || *s == '+';
+    if (i < n) {
+        unsigned long long v = 0;
+        size_t j = i;
+        for (; j < n && isdigit((unsigned char)s[j]) && v <= FIXNUM_MAX; j++)
+            v = v * 10 + (s[j] - '0');
+        if (j == n && v <= (unsigned long long)FIXNUM_MAX + 1) {
+            long long x = *s == '-' ? -(long long)v : (long long)v;
+            return make_integer(x);
+        }
+    }
+    // anything else that may be a number goes through strtod
+    string text(s, n);
+    char *e;
+    errno = 0;
+    double val = strtod(text.c_str(), &e);
+    if (*e != '\0' || errno) return intern(s, n);
+    return make_number(val);
+}
+
+// Builds the next datum from the tokens of lexer, or returns the eof
+// object at the end of the input. Lists and quotes still open are kept on
+// an explicit stack rather than the C++ one, so nesting depth is limited
+// only by memory: each takes three entries, its first and last cells and
+// its state.
+enum { OPEN_LIST, OPEN_DOT, OPEN_CLOSING, OPEN_QUOTE };
+
+template <class L>
+ptr read_datum(L &lexer) {
+    vector<ptr> open;
+    root_vector_guard g(open);
+    ptr x = make_ptr();
+    root_guard gx(x);
+    while (true) {
+        auto t = lexer.next();
+        long long state = open.empty() ? -1 : open.back().fixnum();
+        if (state == OPEN_CLOSING && t.kind != TOK_CLOSE)
+            ERR_EXIT("Read-cdr: expected )");
+        if (t.kind == TOK_END) {
+            if (open.empty()) return make_eof();
+            ERR_EXIT("Read: unexpected EOF");
+        } else if (t.kind == TOK_OPEN || t.kind == TOK_QUOTE) {
+            auto kind = t.kind == TOK_OPEN ? OPEN_LIST : OPEN_QUOTE;
+            open.insert(open.end(), {s_nil, s_nil, make_fixnum(kind)});
+            continue;
+        } else if (t.kind == TOK_DOT) {
+            if (state != OPEN_LIST) ERR_EXIT("Read: unexpected dot");
+            open.back() = make_fixnum(OPEN_DOT);
+            continue;
+        } else if (t.kind == TOK_CLOSE) {
+            if (state != OPEN_LIST && state != OPEN_CLOSING)
+                ERR_EXIT("Read: unexpected )");
+            x = open[open.size() - 3];
+            open.resize(open.size() - 3);
+        } else {
+            x = t.value;
+        }
+        // hand the datum to the innermost open list, quoting it first
+        while (!open.empty() && open.back().fixnum() == OPEN_QUOTE) {
+            open.resize(open.size() - 3);
+            x = cons(x, s_nil);
+            x = cons(s_quote, x);
+        }
+        if (open.empty()) return x;
+        auto n = open.size();
+        bool dotted = open[n - 1].fixnum() == OPEN_DOT;
+        if (dotted)
+            open[n - 1] = make_fixnum(OPEN_CLOSING);
+        else
+            x = cons(x, s_nil);
+        if (eq(open[n - 3], s_nil))
+            open[n - 3] = x;
+        else
+            set_cdr(open[n - 2], x);
+        if (!dotted) open[n - 2] = x;
+    }
+}
+
+// Reads tokens from a stream a character at a time.
+struct stream_lexer {
+    istream *in;
+
+    token next() {
+        int c = in->get();
+        while (isspace(c) || c == ';') {
+            if (c == ';')
+                while (c != '\n' && c != EOF) c = in->get();
+            if (c != EOF) c = in->get();
+        }
+        if (c == EOF) return {TOK_END, s_nil};
+        if (c == '(') return {TOK_OPEN, s_nil};
+        if (c == ')') return {TOK_CLOSE, s_nil};
+        if (c == '.') return {TOK_DOT, s_nil};
+        if (c == '\'') return {TOK_QUOTE, s_nil};
+        if (c == '#') {
+            c = in->get();
+            if (c == '\\') return {TOK_ATOM, make_fixnum(in->get())};
+            if (c == '<') ERR_EXIT("Read: unreadable object");
+            ERR_EXIT("Read: unexpected object");
+        }
+        string s(1, c);
+        while ((c = in->get()) != EOF && !delimp(c)) s += c;
+        if (c != EOF) in->unget();
+        return {TOK_ATOM, parse_atom(s.data(), s.size())};
+    }
+};
+
+ptr read(ptr &port) {
+    if (port.type() != TIPORT) ERR_EXIT("Read: not an input port");
+    stream_lexer lexer{port.iport()};
+    return read_datum(lexer);
+}
+
+// The buffer reader tokenizes a whole source text in memory with a cursor,
+// interning names straight from the text.
+struct buffer_reader {
+    const char *p, *end;
+
+    buffer_reader(const char *text, size_t size)
+        : p(text), end(text + size) {}
+
+    unsigned char cls(const char *q) { return char_class[(unsigned char)*q]; }
+
+    // Skips whitespace and comments; returns false at the end of the text.
+    bool skip() {
+        while (p < end) {
+            if (cls(p) & C_SPACE) {
+                p++;
+            } else if (*p == ';') {
+                while (p < end && *p != '\n') p++;
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    token next() {
+        if (!skip()) return {TOK_END, s_nil};
+        char c = *p++;
+        if (c == '(') return {TOK_OPEN, s_nil};
+        if (c == ')') return {TOK_CLOSE, s_nil};
+        if (c == '.') return {TOK_DOT, s_nil};
+        if (c == '\'') return {TOK_QUOTE, s_nil};
+        if (c == '#') {
+            if (p < end && *p == '\\' && p + 1 < end) {
+                p += 2;
+                return {TOK_ATOM, make_fixnum((unsigned char)p[-1])};
+            } else if (p < end && *p == '<') {
+                ERR_EXIT("Read: unreadable object");
+            }
+            ERR_EXIT("Read: unexpected object");
+        }
+        auto start = --p;
+        while (p < end && !(cls(p) & C_DELIM)) p++;
+        return {TOK_ATOM, parse_atom(start, p - start)};
+    }
+
+    ptr read() { return read_datum(*this); }
+};
+
+// Maps a whole file into memory; data stays null if that fails, for
+// instance because the file is a pipe.
+struct mapped_file {
+    const char *data = nullptr;
+    size_t size = 0;
+    void *map = MAP_FAILED;
+
+    explicit mapped_file(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return;
+        struct stat sb;
+        if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+            size = sb.st_size;
+            if (size == 0)
+                data = "";
+            else if ((map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd,
+                                 0)) != MAP_FAILED)
+                data = (const char *)map;
+        }
+        close(fd);
+    }
+    ~mapped_file() {
+        if (map != MAP_FAILED) munmap(map, size);
+    }
+};
+
+// Prints a value that has no parts.
+void print_atom(ptr p, ostream &out) {
+    if (p.type() == TENV) {
+        out << "#<environment>";
+    } else if (p.type() == TEOF) {
+        out << "#eof";
+    } else if (p.type() == TIPORT) {
+        out << "#<input port>";
+    } else if (p.type() == TOPORT) {
+        out << "#<output port>";
+    } else if (p.type() == TMACRO) {
+        out << "#<macro>";
+    } else if (p.type() == TPROC) {
+        out << "#<procedure>";
+    } else if (p.type() == TPRIM) {
+        out << "#<primitive>";
+    } else if (p.type() == TCODE) {
+        out << "#<code>";
+    } else if (p.type() == THASH) {
+        out << "#<hash table>";
+    } else if (p.type() == TNUM) {
+        out << p.number();
+    } else if (p.type() == TFIX) {
+        out << p.fixnum();
+    } else if (p.type() == TSYM) {
+        out << obarray.name(p.symbol());
+    } else if (p.type() == TUNBOUND) {
+        out << "#<unbound>";
+    } else {
+        ERR_EXIT("Print: unexpected object type: %d", p.type());
+    }
+}
+
+// Lists and vectors are printed with an explicit stack of those still
+// open, so nesting and length are not limited by the C++ stack. A list's
+// entry holds the rest of it, a vector's the vector and the next index.
+void print(const ptr &value, ptr &port) {
+    if (port.type() != TOPORT) ERR_EXIT("Print: not an output port");
+    auto &out = *port.oport();
+    vector<pair<ptr, size_t>> open;
+    auto p = value;
+    while (true) {
+        if (p.type() == TCONS) {
+            out << "(";
+            open.push_back({cell_at(p.index()).cdr, 0});
+            p = cell_at(p.index()).car;
+            continue;
+        }
+        if (p.type() == TVEC) {
+            out << "#(";
+            open.push_back({p, 0});
+        } else {
+            print_atom(p, out);
+        }
+        // find the next element to print, closing what has ended
+        while (true) {
+            if (open.empty()) return;
+            auto &top = open.back();
+            if (top.first.type() == TVEC) {
+                auto &slots = object_slots(top.first);
+                if (top.second < slots.size()) {
+                    if (top.second) out << " ";
+                    p = slots[top.second++];
+                    break;
+                }
+            } else if (top.first.type() == TCONS) {
+                out << " ";
+                p = cell_at(top.first.index()).car;
+                top.first = cell_at(top.first.index()).cdr;
+                break;
+            } else if (!eq(top.first, s_nil)) {
+                out << " . ";
+                p = top.first;
+                top.first = s_nil;
+                break;
+            }
+            out << ")";
+            open.pop_back();
+        }
+    }
+}
+
+ptr make_unbound() { return make_tagged(TUNBOUND, 0); }
+
+// An environment is an object whose slot 0 is the parent environment (nil
+// for the global one), followed by (symbol, value) pairs: first the
+// formals in order, then names created by set!.
+uint64_t name_bit(ptr sym) { return 1ull << (sym.symbol() & 63); }
+
+ptr make_environment(ptr parent, size_t pairs, bool region = false) {
+    root_guard g(parent);
+    auto env = make_object(TENV, 1 + 2 * pairs, s_nil, region);
+    object_slots(env)[0] = parent;
+    return env;
+}
+
+// Marks a symbol with no global binding, as opposed to one bound to the
+// result of (unbound).
+ptr make_absent() { return make_tagged(TUNBOUND, 1); }
+
+bool global_environment_p(ptr env) { return eq(object_slots(env)[0], s_nil); }
+
+ptr global_environment_of(ptr env) {
+    while (!global_environment_p(env)) env = object_slots(env)[0];
+    return env;
+}
+
+ptr global_value(ptr sym) {
+    auto i = sym.symbol();
+    return i < (long long)global_values.size() ? global_values[i]
+                                               : make_absent();
+}
+
+void set_global_value(ptr sym, ptr val) {
+    auto i = sym.symbol();
+    if (i >= (long long)global_values.size())
+        global_values.resize(max<size_t>(i + 1, 2 * global_values.size()),
+                             make_absent());
+    global_values[i] = val;
+}
+
+void define(ptr env, ptr sym, ptr val) {
+    if (global_environment_p(env)) return set_global_value(sym, val);
+    root_guard g1(env), g2(val);
+    object_push(env, sym);
+    object_push(env, val);
+    objects[env.index()].names |= name_bit(sym);
+}
+
+// Finds the innermost binding of sym. Returns the environment holding it
+// and sets `slot` to the position of its value (GLOBAL_SLOT for a global)
+// and `depth` to the number of environments skipped, or returns nil if sym
+// is not bound.
+ptr lookup(ptr env, ptr sym, long long &slot, long long &depth) {
+    if (sym.type() != TSYM) ERR_EXIT("Lookup: not a symbol");
+    auto bit = name_bit(sym);
+    for (depth = 0; !eq(env, s_nil); depth++) {
+        if (env.type() != TENV) ERR_EXIT("Lookup: not an environment");
+        auto &o = objects[env.index()];
+        auto &slots = o.slots;
+        if (!(o.names & bit) && !eq(slots[0], s_nil)) {
+            env = slots[0];
+            continue;
+        }
+        if (eq(slots[0], s_nil)) {
+            if (eq(global_value(sym), make_absent())) break;
+            slot = GLOBAL_SLOT;
+            return env;
+        }
+        for (size_t i = 1; i < slots.size(); i += 2) {
+            if (eq(slots[i], sym)) {
+                slot = i + 1;
+                return env;
+            }
+        }
+        env = slots[0];
+    }
+    return s_nil;
+}
+
+ptr binding_value(ptr frame, long long slot, ptr sym) {
+    return slot == GLOBAL_SLOT ? global_value(sym) : object_slots(frame)[slot];
+}
+
+// Assigns to the innermost binding of sym, creating one in env if there
+// is none.
+void assign(ptr env, ptr sym, ptr val) {
+    if (profiling && (val.type() == TPROC || val.type() == TMACRO))
+        prof.name(val.index(), val.type(), obarray.name(sym.index()));
+    long long slot, depth;
+    auto frame = lookup(env, sym, slot, depth);
+    if (eq(frame, s_nil))
+        define(env, sym, val);
+    else if (slot == GLOBAL_SLOT)
+        set_global_value(sym, val);
+    else
+        object_set(frame, slot, val);
+}
+
+ptr unbound_variable(ptr sym) {
+    print(sym, eport);
+    cerr << ": ";
+    ERR_EXIT("eval: unbound variable");
+}
+
+// Where eval last found the binding of a variable reference: the number of
+// environments skipped and the slot of the value. Addresses are kept off
+// the code, in a direct-mapped table indexed by the cell holding the
+// reference. An entry may be stale, since cells move and are reused and
+// the same code may run in environments of other shapes, so it is only
+// used if the environments it skips cannot bind the name and the one it
+// leads to does.
+struct variable_address {
+    uint32_t cell, symbol, depth, slot;  // slot 0 stands for a global
+};
+const int ADDRESS_TABLE_BITS = 12;
+// the entries start out naming cell 0 with an address no symbol matches
+vector<variable_address> address_table(1 << ADDRESS_TABLE_BITS,
+                                       variable_address{0, ~0u, 0, 0});
+
+bool address_value(const variable_address &a, ptr env, ptr &val) {
+    auto sym = make_symbol(a.symbol);
+    auto bit = name_bit(sym);
+    for (auto depth = a.depth; depth > 0; depth--) {
+        auto &o = objects[env.index()];
+        if (o.names & bit) return false;
+        env = o.slots[0];
+        if (eq(env, s_nil)) return false;
+    }
+    auto &slots = object_slots(env);
+    if (!a.slot) {
+        if (!eq(slots[0], s_nil)) return false;
+        val = global_value(sym);
+        if (eq(val, make_absent())) return false;
+    } else {
+        if (a.slot >= slots.size() || !eq(slots[a.slot - 1], sym))
+            return false;
+        val = slots[a.slot];
+    }
+    if (val.type() == TUNBOUND) unbound_variable(sym);
+    return true;
+}
+
+// Evaluates a variable. When it was read from the car of `cell`, the
+// address of its binding is tried first and recorded afterwards.
+ptr eval_variable(ptr var, ptr env, ptr cell = s_nil) {
+    if (eq(var, s_nil) || eq(var, s_t)) return var;
+    ptr val;
+    variable_address *a = nullptr;
+    if (effective_cons_p(cell)) {
+        a = &address_table[cell.index() & ((1 << ADDRESS_TABLE_BITS) - 1)];
+        if (a->cell == (uint32_t)cell.index() &&
+            a->symbol == (uint32_t)var.symbol() &&
+            address_value(*a, env, val))
+            return val;
+    }
+    long long slot, depth;
+    auto frame = lookup(env, var, slot, depth);
+    if (eq(frame, s_nil)) return unbound_variable(var);
+    val = binding_value(frame, slot, var);
+    if (val.type() == TUNBOUND) return unbound_variable(var);
+    if (a)
+        *a = {(uint32_t)cell.index(), (uint32_t)var.symbol(), (uint32_t)depth,
+              slot == GLOBAL_SLOT ? 0 : (uint32_t)slot};
+    return val;
+}
+
+bool variable_p(ptr p) { return p.type() == TSYM; }
+
+void print_mem() {
+    for (long long i = 0; i < memory_size; i++) {
+        cerr << i << ": ";
+        auto &c = cell_at(i);
+        cerr << c.car.type() << "-";
+        if (effective_cons_p(c.car))
+            cerr << c.car.index();
+        else if (c.car.type() == TNUM)
+            cerr << c.car.number();
+        else if (c.car.type() == TFIX)
+            cerr << c.car.fixnum();
+        else if (c.car.type() == TSYM)
+            print(c.car, eport);
+        cerr << " ";
+        cerr << c.cdr.type() << "-";
+        if (effective_cons_p(c.cdr))
+            cerr << c.cdr.index();
+        else if (c.cdr.type() == TNUM)
+            cerr << c.cdr.number();
+        else if (c.cdr.type() == TFIX)
+            cerr << c.cdr.fixnum();
+        else if (c.cdr.type() == TSYM)
+            print(c.cdr, eport);
+        cerr << endl;
+    }
+}
+
+ptr make_procedure(ptr formals, ptr body, ptr env, type_t type = TPROC) {
+    capture_frames(env);
+    ptr p = make_ptr();
+    root_guard g(p), ge(env);
+    p = cons(formals, body);
+    p = cons(env, p, type);
+    if (profiling) prof.find(p.index(), type);
+    return p;
+}
+
+ptr procedure_formals(ptr f) { return get_car(get_cdr(f)); }
+ptr procedure_body(ptr f) { return get_cdr(get_cdr(f)); }
+ptr procedure_env(ptr f) { return get_car(f); }
+
+ptr eval(ptr expr, ptr env);
+
+// Evaluates the car of cell, looking variables up without entering eval.
+ptr eval_car(ptr cell, ptr env) {
+    auto expr = get_car(cell);
+    return variable_p(expr) ? eval_variable(expr, env, cell) : eval(expr, env);
+}
+
+// Builds the environment in which a procedure with the given formals is
+// applied to args.
+ptr make_frame(ptr formals, ptr args, ptr parent) {
+    root_guard g1(formals), g2(args);
+    size_t n = 0;
+    auto f = formals;
+    for (; f.type() == TCONS; f = get_cdr(f)) n++;
+    if (f.type() != TSYM) ERR_EXIT("Make-frame: expected cons");
+    if (!eq(f, s_nil)) n++;
+    auto env = make_environment(parent, n);
+    // the environment is brand new, so filling it needs no write barrier
+    auto &slots = object_slots(env);
+    size_t i = 1;
+    for (f = formals; f.type() == TCONS; f = get_cdr(f)) {
+        if (get_car(f).type() != TSYM)
+            ERR_EXIT("Make-frame: non-symbol on car of formals");
+        if (args.type() != TCONS) ERR_EXIT("Make-frame: too few arguments");
+        objects[env.index()].names |= name_bit(get_car(f));
+        slots[i++] = get_car(f);
+        slots[i++] = get_car(args);
+        args = get_cdr(args);
+    }
+    if (!eq(f, s_nil)) {
+        objects[env.index()].names |= name_bit(f);
+        slots[i++] = f;
+        slots[i++] = args;
+    } else if (!eq(args, s_nil)) {
+        ERR_EXIT("Make-frame: too many arguments");
+    }
+    return env;
+}
+
+// Like make_frame, but takes the n arguments from the value stack starting
+// at position base. The frame goes in the region, to be released by the
+// caller when the call returns.
+ptr make_frame_from_stack(ptr formals, size_t base, size_t n, ptr parent) {
+    root_guard g1(formals), g2(parent);
+    size_t k = 0;
+    auto f = formals;
+    for (; f.type() == TCONS; f = get_cdr(f)) k++;
+    if (f.type() != TSYM) ERR_EXIT("Make-frame: expected cons");
+    bool rest = !eq(f, s_nil);
+    if (n < k) ERR_EXIT("Make-frame: too few arguments");
+    if (n > k && !rest) ERR_EXIT("Make-frame: too many arguments");
+    auto rest_args = s_nil;
+    root_guard g3(rest_args);
+    for (auto i = base + n; i > base + k; i--)
+        rest_args = cons(value_stack[i - 1], rest_args);
+    auto env = make_environment(parent, k + rest, true);
+    // the environment is brand new, so filling it needs no write barrier
+    auto &slots = object_slots(env);
+    size_t i = 1, j = base;
+    for (f = formals; f.type() == TCONS; f = get_cdr(f)) {
+        if (get_car(f).type() != TSYM)
+            ERR_EXIT("Make-frame: non-symbol on car of formals");
+        objects[env.index()].names |= name_bit(get_car(f));
+        slots[i++] = get_car(f);
+        slots[i++] = value_stack[j++];
+    }
+    if (rest) {
+        objects[env.index()].names |= name_bit(f);
+        slots[i++] = f;
+        slots[i++] = rest_args;
+    }
+    return env;
+}
+
+// Primitives take their arguments as an array of n values, which stays on
+// the value stack (and so is updated by the collector) during the call.
+ptr cons_prim(ptr *args, size_t n) { return cons(args[0], args[1]); }
+ptr consp_prim(ptr *args, size_t n) {
+    return args[0].type() == TCONS ? s_t : s_nil;
+}
+// Arithmetic stays on fixnums until an operand is a float or a result
+// leaves the fixnum range, and continues in double precision from there.
+ptr plus_prim(ptr *args, size_t n) {
+    long long sum = 0;
+    double fsum = 0;
+    bool exact = true;
+    for (size_t i = 0; i < n; i++) {
+        auto c = args[i];
+        if (!number_p(c)) ERR_EXIT("+: not a number");
+        if (exact && c.type() == TFIX &&
+            !__builtin_add_overflow(sum, c.fixnum(), &sum))
+            continue;
+        if (exact) fsum = sum, exact = false;
+        fsum += to_double(c);
+    }
+    return exact ? make_integer(sum) : make_number(fsum);
+}
+ptr times_prim(ptr *args, size_t n) {
+    long long prod = 1;
+    double fprod = 1;
+    bool exact = true;
+    for (size_t i = 0; i < n; i++) {
+        auto c = args[i];
+        if (!number_p(c)) ERR_EXIT("*: not a number");
+        if (exact && c.type() == TFIX &&
+            !__builtin_mul_overflow(prod, c.fixnum(), &prod))
+            continue;
+        if (exact) fprod = prod, exact = false;
+        fprod *= to_double(c);
+    }
+    return exact ? make_integer(prod) : make_number(fprod);
+}
+ptr minus_prim(ptr *args, size_t n) {
+    auto first = args[0];
+    if (!number_p(first)) ERR_EXIT("-: expected number");
+    if (n == 1) {
+        if (first.type() == TFIX) return make_integer(-first.fixnum());
+        return make_number(-first.number());
+    }
+    bool exact = first.type() == TFIX;
+    long long diff = exact ? first.fixnum() : 0;
+    double fdiff = to_double(first);
+    for (size_t i = 1; i < n; i++) {
+        auto c = args[i];
+        if (!number_p(c)) ERR_EXIT("-: not a number");
+        if (exact && c.type() == TFIX &&
+            !__builtin_sub_overflow(diff, c.fixnum(), &diff))
+            continue;
+        if (exact) fdiff = diff, exact = false;
+        fdiff -= to_double(c);
+    }
+    return exact ? make_integer(diff) : make_number(fdiff);
+}
+ptr divide_prim(ptr *args, size_t n) {
+    auto first = args[0];
+    if (!number_p(first)) ERR_EXIT("/: expected number");
+    if (n == 1) {
+        if (first.type() == TFIX && abs(first.fixnum()) == 1) return first;
+        return make_number(1 / to_double(first));
+    }
+    // quotients stay exact while every division is
+    bool exact = first.type() == TFIX;
+    long long quotient = exact ? first.fixnum() : 0;
+    double fquotient = to_double(first);
+    for (size_t i = 1; i < n; i++) {
+        auto c = args[i];
+        if (!number_p(c)) ERR_EXIT("/: not a number");
+        if (exact && c.type() == TFIX && c.fixnum() != 0 &&
+            quotient % c.fixnum() == 0) {
+            quotient /= c.fixnum();
+            continue;
+        }
+        if (exact) fquotient = quotient, exact = false;
+        fquotient /= to_double(c);
+    }
+    return exact ? make_integer(quotient) : make_number(fquotient);
+}
+ptr equal_prim(ptr *args, size_t n) {
+    for (size_t i = 0; i + 1 < n; i++) {
+        auto a = args[i], b = args[i + 1];
+        if (!number_p(a) || !number_p(b)) ERR_EXIT("=: expected number");
+        if (a.type() == TFIX && b.type() == TFIX) {
+            if (!eq(a, b)) return s_nil;
+        } else if (to_double(a) != to_double(b)) {
+            return s_nil;
+        }
+    }
+    return s_t;
+}
+ptr less_prim(ptr *args, size_t n) {
+    for (size_t i = 0; i + 1 < n; i++) {
+        auto a = args[i], b = args[i + 1];
+        if (!number_p(a) || !number_p(b)) ERR_EXIT("<: expected number");
+        if (a.type() == TFIX && b.type() == TFIX) {
+            if (a.fixnum() >= b.fixnum()) return s_nil;
+        } else if (!(to_double(a) < to_double(b))) {
+            return s_nil;
+        }
+    }
+    return s_t;
+}
+// Collector totals under the names used by the exit report.
+vector<pair<const char *, long long>> gc_counters() {
+    auto &s = gc_stats;
+    return {{"conses", s.cells_allocated},
+            {"objects", s.objects_allocated},
+            {"minor_gcs", s.minor_collections},
+            {"major_gcs", s.major_collections},
+            {"promoted_cells", s.cells_promoted},
+            {"freed_cells", s.cells_freed},
+            {"freed_objects", s.objects_freed},
+            {"released_frames", s.frames_released},
+            {"heap_growths", s.heap_growths},
+            {"minor_pause_us", s.minor_pause_total},
+            {"major_pause_us", s.major_pause_total},
+            {"max_minor_pause_us", s.minor_pause_max},
+            {"max_major_pause_us", s.major_pause_max},
+            {"peak_heap_cells", memory_size},
+            {"peak_objects", (long long)objects.size()}};
+}
+
+// Prints the totals and pause histograms to stderr as one line of
+// key=value pairs, the format bench/run.sh collects.
+void report_gc_stats() {
+    for (auto &c : gc_counters()) cerr << c.first << "=" << c.second << " ";
+    for (auto h : {gc_stats.minor_pauses, gc_stats.major_pauses}) {
+        auto minor = h == gc_stats.minor_pauses;
+        cerr << (minor ? "minor_pauses=" : "major_pauses=");
+        for (int b = 0; b < PAUSE_BUCKETS; b++)
+            cerr << h[b] << (b + 1 < PAUSE_BUCKETS ? "," : "");
+        cerr << (minor ? " " : "\n");
+    }
+}
+
+// Returns the collector statistics as an association list from symbols to
+// numbers, with each pause histogram as a list of bucket counts.
+ptr gc_stats_prim(ptr *args, size_t n) {
+    ptr result = s_nil, entry = s_nil, value = s_nil;
+    root_guard g1(result), g2(entry), g3(value);
+    auto add = [&](const char *name) {
+        string key = name;
+        replace(key.begin(), key.end(), '_', '-');
+        entry = cons(intern(key.c_str()), value);
+        result = cons(entry, result);
+    };
+    for (auto h : {gc_stats.major_pauses, gc_stats.minor_pauses}) {
+        value = s_nil;
+        for (int b = PAUSE_BUCKETS; b-- > 0;)
+            value = cons(make_integer(h[b]), value);
+        add(h == gc_stats.minor_pauses ? "minor_pauses" : "major_pauses");
+    }
+    auto counters = gc_counters();
+    for (auto c = counters.rbegin(); c != counters.rend(); c++) {
+        value = make_integer(c->second);
+        add(c->first);
+    }
+    return result;
+}
+ptr car_prim(ptr *args, size_t n) { return get_car(args[0]); }
+ptr cdr_prim(ptr *args, size_t n) { return get_cdr(args[0]); }
+ptr null_prim(ptr *args, size_t n) { return eq(args[0], s_nil) ? s_t : s_nil; }
+ptr eq_prim(ptr *args, size_t n) {
+    return eq(args[0], args[1]) ? s_t : s_nil;
+}
+ptr unbound_prim(ptr *args, size_t n) { return make_unbound(); }
+long long gensym_counter = 0;
+
+ptr gensym_prim(ptr *args, size_t n) {
+    gensym_counter++;
+    string s = "gensym-" + to_string(gensym_counter);
+    return intern(s.c_str());
+}
+ptr symbolp_prim(ptr *args, size_t n) {
+    return args[0].type() == TSYM ? s_t : s_nil;
+}
+
+// Vectors are heap objects whose slots are the elements.
+ptr vector_arg(ptr p, const char *who) {
+    if (p.type() != TVEC) ERR_EXIT("%s: not a vector", who);
+    return p;
+}
+size_t index_arg(ptr p, size_t size, const char *who) {
+    if (p.type() != TFIX || p.fixnum() < 0 || (size_t)p.fixnum() >= size)
+        ERR_EXIT("%s: index out of range", who);
+    return p.fixnum();
+}
+ptr vectorp_prim(ptr *args, size_t n) {
+    return args[0].type() == TVEC ? s_t : s_nil;
+}
+ptr make_vector_prim(ptr *args, size_t n) {
+    if (args[0].type() != TFIX || args[0].fixnum() < 0)
+        ERR_EXIT("make-vector: bad length");
+    return make_object(TVEC, args[0].fixnum(), n > 1 ? args[1] : s_nil);
+}
+ptr vector_prim(ptr *args, size_t n) {
+    auto v = make_object(TVEC, n, s_nil);
+    for (size_t i = 0; i < n; i++) object_set(v, i, args[i]);
+    return v;
+}
+ptr vector_length_prim(ptr *args, size_t n) {
+    return make_integer(object_slots(vector_arg(args[0], "vector-length"))
+                            .size());
+}
+ptr vector_ref_prim(ptr *args, size_t n) {
+    auto &slots = object_slots(vector_arg(args[0], "vector-ref"));
+    return slots[index_arg(args[1], slots.size(), "vector-ref")];
+}
+ptr vector_set_prim(ptr *args, size_t n) {
+    auto v = vector_arg(args[0], "vector-set!");
+    object_set(v, index_arg(args[1], object_slots(v).size(), "vector-set!"),
+               args[2]);
+    return args[2];
+}
+ptr vector_fill_prim(ptr *args, size_t n) {
+    auto v = vector_arg(args[0], "vector-fill!");
+    gc_object_barrier(v.index(), args[1]);
+    auto &slots = object_slots(v);
+    fill(slots.begin(), slots.end(), args[1]);
+    return v;
+}
+// (vector-copy v [start [end]]) copies the elements from start to end.
+ptr vector_copy_prim(ptr *args, size_t n) {
+    auto size = object_slots(vector_arg(args[0], "vector-copy")).size();
+    size_t start = n > 1 ? index_arg(args[1], size + 1, "vector-copy") : 0;
+    size_t end = n > 2 ? index_arg(args[2], size + 1, "vector-copy") : size;
+    if (end < start) ERR_EXIT("vector-copy: bad range");
+    auto copy = make_object(TVEC, 0, s_nil);
+    auto &from = object_slots(args[0]);
+    object_slots(copy).assign(from.begin() + start, from.begin() + end);
+    for (auto q : object_slots(copy)) gc_object_barrier(copy.index(), q);
+    return copy;
+}
+ptr list_to_vector_prim(ptr *args, size_t n) {
+    size_t size = 0;
+    auto p = args[0];
+    for (; p.type() == TCONS; p = get_cdr(p)) size++;
+    if (!eq(p, s_nil)) ERR_EXIT("list->vector: not a proper list");
+    auto v = make_object(TVEC, size, s_nil);
+    size_t i = 0;
+    for (p = args[0]; p.type() == TCONS; p = get_cdr(p))
+        object_set(v, i++, get_car(p));
+    return v;
+}
+ptr vector_to_list_prim(ptr *args, size_t n) {
+    auto v = vector_arg(args[0], "vector->list");
+    ptr result = s_nil;
+    root_guard g(result);
+    for (auto i = object_slots(v).size(); i-- > 0;)
+        result = cons(object_slots(v)[i], result);
+    return result;
+}
+
+// A hash table is an object holding its count, the number of slots in use
+// including deleted ones, and then open-addressed (key, value) pairs, whose
+// number is a power of two. Keys are compared with eq.
+const ptr empty_key = make_tagged(TUNBOUND, 2),
+          deleted_key = make_tagged(TUNBOUND, 3);
+const size_t TABLE_MIN_CAPACITY = 8;
+
+size_t table_hash(ptr key, size_t capacity) {
+    return (key.bits * 0x9e3779b97f4a7c15ull >> 17) & (capacity - 1);
+}
+
+// Returns the slot of key's pair, or of the pair it would be added in.
+size_t table_find(object_vector<ptr> &slots, ptr key) {
+    size_t capacity = (slots.size() - 2) / 2, tomb = 0;
+    for (auto i = table_hash(key, capacity);; i = (i + 1) & (capacity - 1)) {
+        auto k = slots[2 + 2 * i];
+        if (eq(k, key)) return 2 + 2 * i;
+        if (eq(k, empty_key)) return tomb ? tomb : 2 + 2 * i;
+        if (!tomb && eq(k, deleted_key)) tomb = 2 + 2 * i;
+    }
+}
+
+void table_rehash(long long id, size_t capacity) {
+    auto &slots = objects[id].slots;
+    vector<ptr> old(slots.begin() + 2, slots.end());
+    slots.assign(2 + 2 * capacity, empty_key);
+    slots[0] = slots[1] = make_fixnum(0);
+    long long count = 0;
+    for (size_t i = 0; i < old.size(); i += 2) {
+        if (eq(old[i], empty_key) || eq(old[i], deleted_key)) continue;
+        auto j = table_find(slots, old[i]);
+        slots[j] = old[i];
+        slots[j + 1] = old[i + 1];
+        count++;
+    }
+    slots[0] = slots[1] = make_fixnum(count);
+}
+
+ptr table_arg(ptr p, const char *who) {
+    if (p.type() != THASH) ERR_EXIT("%s: not a hash table", who);
+    return p;
+}
+ptr hash_table_prim(ptr *args, size_t n) {
+    auto t = make_object(THASH, 2 + 2 * TABLE_MIN_CAPACITY, empty_key);
+    object_slots(t)[0] = object_slots(t)[1] = make_fixnum(0);
+    return t;
+}
+ptr hash_tablep_prim(ptr *args, size_t n) {
+    return args[0].type() == THASH ? s_t : s_nil;
+}
+// (hash-table-get table key [default]) returns default, or nil, for a
+// missing key.
+ptr hash_table_get_prim(ptr *args, size_t n) {
+    auto &slots = object_slots(table_arg(args[0], "hash-table-get"));
+    auto i = table_find(slots, args[1]);
+    return eq(slots[i], args[1]) ? slots[i + 1] : n > 2 ? args[2] : s_nil;
+}
+ptr hash_table_put_prim(ptr *args, size_t n) {
+    auto t = table_arg(args[0], "hash-table-put!");
+    auto &slots = object_slots(t);
+    auto capacity = (slots.size() - 2) / 2;
+    // keep at most three quarters of the pairs in use, growing the table
+    // unless most of them are deleted ones
+    if (4 * (slots[1].fixnum() + 1) > 3 * (long long)capacity) {
+        bool grow = 2 * (slots[0].fixnum() + 1) > (long long)capacity;
+        table_rehash(t.index(), grow ? 2 * capacity : capacity);
+    }
+    auto i = table_find(slots, args[1]);
+    if (!eq(slots[i], args[1])) {
+        slots[0] = make_fixnum(slots[0].fixnum() + 1);
+        if (eq(slots[i], empty_key))
+            slots[1] = make_fixnum(slots[1].fixnum() + 1);
+        object_set(t, i, args[1]);
+    }
+    object_set(t, i + 1, args[2]);
+    return args[2];
+}
+ptr hash_table_delete_prim(ptr *args, size_t n) {
+    auto &slots = object_slots(table_arg(args[0], "hash-table-delete!"));
+    auto i = table_find(slots, args[1]);
+    if (!eq(slots[i], args[1])) return s_nil;
+    slots[i] = deleted_key;
+    slots[i + 1] = s_nil;
+    slots[0] = make_fixnum(slots[0].fixnum() - 1);
+    return s_t;
+}
+ptr hash_table_count_prim(ptr *args, size_t n) {
+    return object_slots(table_arg(args[0], "hash-table-count"))[0];
+}
+// Returns the entries as a list of (key . value) pairs.
+ptr hash_table_to_alist_prim(ptr *args, size_t n) {
+    // the pairs are copied first, as a collection rehashes the table
+    vector<ptr> pairs;
+    root_vector_guard g(pairs);
+    auto &slots = object_slots(table_arg(args[0], "hash-table->alist"));
+    for (size_t i = 2; i < slots.size(); i += 2)
+        if (!eq(slots[i], empty_key) && !eq(slots[i], deleted_key))
+            pairs.push_back(slots[i]), pairs.push_back(slots[i + 1]);
+    ptr result = s_nil, entry = s_nil;
+    root_guard g1(result), g2(entry);
+    for (auto i = pairs.size(); i > 0; i -= 2) {
+        entry = cons(pairs[i - 2], pairs[i - 1]);
+        result = cons(entry, result);
+    }
+    return result;
+}
+
+// Ports opened by Lisp code own their file streams, which get large
+// buffers and are flushed only when full, on flush-output and on closing.
+// A closed port's stream is freed and its slot left empty. Streams still
+// open are flushed on exit, when file_ports is destroyed.
+const size_t PORT_BUFFER_SIZE = 1 << 16;
+struct file_port {
+    unique_ptr<char[]> buffer;
+    unique_ptr<ios> stream;
+};
+unordered_map<uint64_t, file_port> file_ports;
+
+istream &input_port_arg(ptr p, const char *who) {
+    if (p.type() != TIPORT) ERR_EXIT("%s: not an input port", who);
+    if (!p.iport()) ERR_EXIT("%s: port is closed", who);
+    return *p.iport();
+}
+// The output port given as args[i], or standard output without one.
+ostream &output_port_arg(ptr *args, size_t n, size_t i, const char *who) {
+    auto p = i < n ? args[i] : oport;
+    if (p.type() != TOPORT) ERR_EXIT("%s: not an output port", who);
+    if (!p.oport()) ERR_EXIT("%s: port is closed", who);
+    return *p.oport();
+}
+
+void flush_output_ports() {
+    for (auto out : ostreams)
+        if (out) out->flush();
+}
+
+ptr display_prim(ptr *args, size_t n) {
+    output_port_arg(args, n, 1, "display");
+    print(args[0], n > 1 ? args[1] : oport);
+    return intern("display");
+}
+ptr newline_prim(ptr *args, size_t n) {
+    output_port_arg(args, n, 0, "newline") << '\n';
+    return intern("newline");
+}
+// File names are symbols.
+ptr open_input_file_prim(ptr *args, size_t n) {
+    if (args[0].type() != TSYM) ERR_EXIT("open-input-file: bad file name");
+    string name(obarray.name(args[0].symbol()));
+    auto buffer = make_unique<char[]>(PORT_BUFFER_SIZE);
+    auto in = new ifstream;
+    in->rdbuf()->pubsetbuf(buffer.get(), PORT_BUFFER_SIZE);
+    file_port f{move(buffer), unique_ptr<ios>(in)};
+    in->open(name);
+    if (!*in) ERR_EXIT("open-input-file: cannot open %s", name.c_str());
+    auto port = make_input_port(in);
+    file_ports[port.bits] = move(f);
+    return port;
+}
+// (open-output-file name [append]) truncates the file unless append is
+// true.
+ptr open_output_file_prim(ptr *args, size_t n) {
+    if (args[0].type() != TSYM) ERR_EXIT("open-output-file: bad file name");
+    string name(obarray.name(args[0].symbol()));
+    auto buffer = make_unique<char[]>(PORT_BUFFER_SIZE);
+    auto out = new ofstream;
+    out->rdbuf()->pubsetbuf(buffer.get(), PORT_BUFFER_SIZE);
+    file_port f{move(buffer), unique_ptr<ios>(out)};
+    out->open(name, n > 1 && !eq(args[1], s_nil) ? ios::app : ios::trunc);
+    if (!*out) ERR_EXIT("open-output-file: cannot open %s", name.c_str());
+    auto port = make_output_port(out);
+    file_ports[port.bits] = move(f);
+    return port;
+}
+// Closing a standard port only flushes it.
+// Closing a port that is already closed does nothing.
+ptr close_port_prim(ptr *args, size_t n) {
+    auto p = args[0];
+    if (p.type() == TOPORT) {
+        if (!p.oport()) return s_t;
+        p.oport()->flush();
+    } else if (p.type() == TIPORT) {
+        if (!p.iport()) return s_t;
+    } else {
+        ERR_EXIT("close-port: not a port");
+    }
+    if (!file_ports.erase(p.bits)) return s_t;
+    if (p.type() == TOPORT)
+        ostreams[p.index()] = nullptr;
+    else
+        istreams[p.index()] = nullptr;
+    return s_t;
+}
+ptr flush_output_prim(ptr *args, size_t n) {
+    output_port_arg(args, n, 0, "flush-output").flush();
+    return s_t;
+}
+ptr read_prim(ptr *args, size_t n) {
+    input_port_arg(args[0], "read");
+    return read(args[0]);
+}
+// Lines are read as vectors of character codes, without the newline.
+ptr read_line_prim(ptr *args, size_t n) {
+    string line;
+    if (!getline(input_port_arg(args[0], "read-line"), line))
+        return make_eof();
+    auto v = make_object(TVEC, line.size(), s_nil);
+    auto &slots = object_slots(v);
+    for (size_t i = 0; i < line.size(); i++)
+        slots[i] = make_fixnum((unsigned char)line[i]);
+    return v;
+}
+int char_arg(ptr p, const char *who) {
+    if (p.type() != TFIX || p.fixnum() < 0 || p.fixnum() > 255)
+        ERR_EXIT("%s: not a character", who);
+    return p.fixnum();
+}
+ptr write_char_prim(ptr *args, size_t n) {
+    output_port_arg(args, n, 1, "write-char")
+        .put(char_arg(args[0], "write-char"));
+    return args[0];
+}
+// Writes a vector of character codes, as read-line returns, and a newline.
+ptr write_line_prim(ptr *args, size_t n) {
+    auto &out = output_port_arg(args, n, 1, "write-line");
+    for (auto c : object_slots(vector_arg(args[0], "write-line")))
+        out.put(char_arg(c, "write-line"));
+    out.put('\n');
+    return args[0];
+}
+ptr eofp_prim(ptr *args, size_t n) {
+    return args[0].type() == TEOF ? s_t : s_nil;
+}
+
+// Numeric reductions run over the raw slots. They stay exact while every
+// element is a fixnum and work in double precision otherwise; the loops
+// carry nothing from one element to the next but the accumulators, so the
+// compiler can vectorize them.
+bool fixnum_slots(const object_vector<ptr> &slots, const char *who) {
+    bool numbers = true, fixnums = true;
+    for (auto q : slots) {
+        numbers &= number_p(q);
+        fixnums &= q.type() == TFIX;
+    }
+    if (!numbers) ERR_EXIT("%s: not a number", who);
+    return fixnums;
+}
+const int LANES = 4;  // independent partial sums of the floating loops
+ptr vector_sum_prim(ptr *args, size_t n) {
+    auto &slots = object_slots(vector_arg(args[0], "vector-sum"));
+    auto size = slots.size();
+    if (fixnum_slots(slots, "vector-sum")) {
+        // blocks of 2^19 fixnums of 44 bits cannot overflow a long long
+        const size_t BLOCK = 1 << 19;
+        long long sum = 0;
+        bool exact = true;
+        for (size_t i = 0; i < size && exact; i += BLOCK) {
+            long long part = 0;
+            for (size_t j = i; j < min(size, i + BLOCK); j++)
+                part += slots[j].fixnum();
+            exact = !__builtin_add_overflow(sum, part, &sum);
+        }
+        if (exact) return make_integer(sum);
+    }
+    double acc[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= size; i += LANES)
+        for (int k = 0; k < LANES; k++) acc[k] += to_double(slots[i + k]);
+    for (; i < size; i++) acc[0] += to_double(slots[i]);
+    return make_number((acc[0] + acc[1]) + (acc[2] + acc[3]));
+}
+ptr vector_extreme(ptr *args, bool maximum, const char *who) {
+    auto &slots = object_slots(vector_arg(args[0], who));
+    if (slots.empty()) ERR_EXIT("%s: empty vector", who);
+    if (fixnum_slots(slots, who)) {
+        auto m = slots[0].fixnum();
+        for (auto q : slots)
+            m = maximum ? max(m, q.fixnum()) : min(m, q.fixnum());
+        return make_fixnum(m);
+    }
+    auto m = to_double(slots[0]);
+    for (auto q : slots) {
+        auto d = to_double(q);
+        m = maximum ? (d > m ? d : m) : (d < m ? d : m);
+    }
+    return make_number(m);
+}
+ptr vector_min_prim(ptr *args, size_t n) {
+    return vector_extreme(args, false, "vector-min");
+}
+ptr vector_max_prim(ptr *args, size_t n) {
+    return vector_extreme(args, true, "vector-max");
+}
+ptr vector_dot_prim(ptr *args, size_t n) {
+    auto &a = object_slots(vector_arg(args[0], "vector-dot"));
+    auto &b = object_slots(vector_arg(args[1], "vector-dot"));
+    if (a.size() != b.size()) ERR_EXIT("vector-dot: lengths differ");
+    auto size = a.size();
+    bool fixnums = fixnum_slots(a, "vector-dot");
+    if (fixnum_slots(b, "vector-dot") && fixnums) {
+        long long sum = 0, product;
+        size_t i = 0;
+        for (; i < size; i++)
+            if (__builtin_mul_overflow(a[i].fixnum(), b[i].fixnum(),
+                                       &product) ||
+                __builtin_add_overflow(sum, product, &sum))
+                break;
+        if (i == size) return make_integer(sum);
+    }
+    double acc[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= size; i += LANES)
+        for (int k = 0; k < LANES; k++)
+            acc[k] += to_double(a[i + k]) * to_double(b[i + k]);
+    for (; i < size; i++) acc[0] += to_double(a[i]) * to_double(b[i]);
+    return make_number((acc[0] + acc[1]) + (acc[2] + acc[3]));
+}
+
+// (eval expr) and (apply f arg... list) are carried out by the engines,
+// which make the call they lead to a tail call; these functions only
+// identify them.
+ptr eval_prim(ptr *args, size_t n) {
+    ERR_EXIT("eval: not called by eval");
+}
+ptr apply_prim(ptr *args, size_t n) {
+    ERR_EXIT("apply: not called by eval");
+}
+
+// Replaces the arguments of apply, starting at position base of the value
+// stack, by the procedure and the arguments to call it with, and returns
+// their number.
+size_t spread_arguments(size_t base, size_t n) {
+    auto list = value_stack[base + n - 1];
+    value_stack.pop_back();
+    n--;
+    for (; list.type() == TCONS; list = get_cdr(list), n++)
+        value_stack.push_back(get_car(list));
+    if (!eq(list, s_nil)) ERR_EXIT("apply: not a list");
+    return n;
+}
+
+// A maximum arity of -1 means any number of arguments.
+struct primitive {
+    const char *name;
+    ptr (*fn)(ptr *args, size_t n);
+    int min_args, max_args;
+};
+
+vector<primitive> primitives{
+    {"cons", cons_prim, 2, 2},       {"consp", consp_prim, 1, 1},
+    {"car", car_prim, 1, 1},         {"cdr", cdr_prim, 1, 1},
+    {"+", plus_prim, 0, -1},         {"*", times_prim, 0, -1},
+    {"-", minus_prim, 1, -1},        {"/", divide_prim, 1, -1},
+    {"=", equal_prim, 0, -1},        {"null", null_prim, 1, 1},
+    {"eq", eq_prim, 2, 2},           {"unbound", unbound_prim, 0, 0},
+    {"gensym", gensym_prim, 0, 0},   {"symbolp", symbolp_prim, 1, 1},
+    {"display", display_prim, 1, 2}, {"newline", newline_prim, 0, 1},
+    {"<", less_prim, 0, -1},         {"gc-stats", gc_stats_prim, 0, 0},
+    {"vectorp", vectorp_prim, 1, 1},
+    {"make-vector", make_vector_prim, 1, 2},
+    {"vector", vector_prim, 0, -1},
+    {"vector-length", vector_length_prim, 1, 1},
+    {"vector-ref", vector_ref_prim, 2, 2},
+    {"vector-set!", vector_set_prim, 3, 3},
+    {"vector-fill!", vector_fill_prim, 2, 2},
+    {"vector-copy", vector_copy_prim, 1, 3},
+    {"list->vector", list_to_vector_prim, 1, 1},
+    {"vector->list", vector_to_list_prim, 1, 1},
+    {"vector-sum", vector_sum_prim, 1, 1},
+    {"vector-min", vector_min_prim, 1, 1},
+    {"vector-max", vector_max_prim, 1, 1},
+    {"vector-dot", vector_dot_prim, 2, 2},
+    {"make-hash-table", hash_table_prim, 0, 0},
+    {"hash-table-p", hash_tablep_prim, 1, 1},
+    {"hash-table-get", hash_table_get_prim, 2, 3},
+    {"hash-table-put!", hash_table_put_prim, 3, 3},
+    {"hash-table-delete!", hash_table_delete_prim, 2, 2},
+    {"hash-table-count", hash_table_count_prim, 1, 1},
+    {"hash-table->alist", hash_table_to_alist_prim, 1, 1},
+    {"open-input-file", open_input_file_prim, 1, 1},
+    {"open-output-file", open_output_file_prim, 1, 2},
+    {"close-port", close_port_prim, 1, 1},
+    {"flush-output", flush_output_prim, 0, 1},
+    {"read", read_prim, 1, 1},
+    {"read-line", read_line_prim, 1, 1},
+    {"write-char", write_char_prim, 1, 2},
+    {"write-line", write_line_prim, 1, 2},
+    {"eofp", eofp_prim, 1, 1},
+    {"eval", eval_prim, 1, 1},
+    {"apply", apply_prim, 2, -1}};
+
+// Calls primitive f on the n values at args after checking its arity. The
+// most common primitives are called directly so they can be inlined, with
+// two-fixnum arithmetic handled before any call at all.
+void check_arity(ptr f, size_t n) {
+    auto &prim = primitives[f.index()];
+    if ((int)n < prim.min_args ||
+        (prim.max_args >= 0 && (int)n > prim.max_args)) {
+        cerr << prim.name << ": ";
+        ERR_EXIT("wrong number of arguments");
+    }
+}
+
+ptr call_primitive(ptr f, ptr *args, size_t n) {
+    check_arity(f, n);
+    auto fn = primitives[f.index()].fn;
+    if (fn == car_prim) return car_prim(args, n);
+    if (fn == cdr_prim) return cdr_prim(args, n);
+    if (fn == cons_prim) return cons_prim(args, n);
+    if ((fn == plus_prim || fn == minus_prim) && n == 2 &&
+        args[0].type() == TFIX && args[1].type() == TFIX) {
+        // fixnums are 44 bits wide, so this cannot overflow a long long
+        auto a = args[0].fixnum(), b = args[1].fixnum();
+        return make_integer(fn == plus_prim ? a + b : a - b);
+    }
+    return fn(args, n);
+}
+
+// Releases the frame an activation of eval made for the call it is
+// running, once that call is over.
+struct frame_guard {
+    ptr frame = s_nil;
+    ~frame_guard() { release_frame(frame); }
+    void replace(ptr f) {
+        release_frame(frame);
+        frame = f;
+    }
+};
+
+// Closes the profiled call an activation of eval is running, if any.
+struct profile_guard {
+    bool active = false;
+    ~profile_guard() {
+        if (active) prof.exit();
+    }
+    void enter(ptr p) {
+        if (active) prof.exit();
+        prof.enter(p.index(), TPROC);
+        active = true;
+    }
+};
+
+ptr eval(ptr expr, ptr env) {
+    frame_guard fg;
+    profile_guard pg;
+eval_start:
+    // print_mem();
+    // print(expr, eport);
+    // cerr << " ";
+    // for (auto p = env; !eq(p, s_nil); p = object_slots(p)[0]) {
+    //     print(p, eport);
+    //     cerr << " ";
+    // }
+    // cerr << endl << endl;
+    root_guard g1(expr), g2(env);
+    auto orig_env = env;
+    root_guard g3(orig_env);
+    if (expr.type() != TCONS) {
+        if (variable_p(expr)) return eval_variable(expr, env);
+        return expr;
+    }
+    if (eq(get_car(expr), s_quote)) return get_car(get_cdr(expr));
+    if (eq(get_car(expr), s_if)) {
+        auto p = make_ptr();
+        root_guard g(p);
+        p = eval_car(get_cdr(expr), env);
+        auto branch = get_cdr(get_cdr(expr));
+        if (eq(p, s_nil)) {
+            // alternative or nil
+            if (eq(get_cdr(branch), s_nil)) return s_nil;
+            branch = get_cdr(branch);
+        }
+        if (variable_p(get_car(branch)))
+            return eval_variable(get_car(branch), env, branch);
+        expr = get_car(branch);
+        goto eval_start;  // tail call to eval
+    }
+    if (eq(get_car(expr), s_set)) {
+        auto val = make_ptr();
+        root_guard g(val);
+        val = eval_car(get_cdr(get_cdr(expr)), env);
+        auto sym = get_car(get_cdr(expr));
+        assign(env, sym, val);
+        return sym;
+    }
+    if (eq(get_car(expr), s_lambda)) {
+        return make_procedure(get_car(get_cdr(expr)), get_cdr(get_cdr(expr)),
+                              env, TPROC);
+    }
+    if (eq(get_car(expr), s_syntax)) {
+        return make_procedure(get_car(get_cdr(expr)), get_cdr(get_cdr(expr)),
+                              env, TMACRO);
+    }
+    auto p = make_ptr(), args = make_ptr();
+    root_guard gg1(p), gg2(args);
+    p = eval_car(expr, env);
+    if (p.type() == TPROC || p.type() == TPRIM) {
+        // arguments are evaluated onto the value stack, so calls need no
+        // argument list
+        auto base = value_stack.size();
+        size_t n = 0;
+        for (args = get_cdr(expr); args.type() == TCONS; args = get_cdr(args)) {
+            value_stack.push_back(eval_car(args, env));
+            n++;
+        }
+        while (p.type() == TPRIM) {
+            auto fn = primitives[p.index()].fn;
+            if (fn != eval_prim && fn != apply_prim) {
+                auto r = call_primitive(p, value_stack.data() + base, n);
+                value_stack.resize(base);
+                return r;
+            }
+            check_arity(p, n);
+            if (fn == eval_prim) {
+                expr = value_stack[base];
+                value_stack.resize(base);
+                env = global_environment_of(env);
+                goto eval_start;
+            }
+            n = spread_arguments(base, n) - 1;
+            p = value_stack[base];
+            value_stack.erase(value_stack.begin() + base);
+        }
+        if (p.type() != TPROC) ERR_EXIT("apply: not a procedure");
+        // apply
+        auto body = make_ptr(), newenv = make_ptr();
+        root_guard g1(body), g2(newenv);
+        body = procedure_body(p);
+        newenv = make_frame_from_stack(procedure_formals(p), base, n,
+                                       procedure_env(p));
+        value_stack.resize(base);
+        // the call this activation was running, if any, is over
+        fg.replace(newenv);
+        if (profiling) pg.enter(p);
+        if (eq(body, s_nil)) return s_nil;
+        while (!eq(get_cdr(body), s_nil)) {
+            eval_car(body, newenv);
+            body = get_cdr(body);
+        }
+        // special handling for last clause in lambda
+        if (variable_p(get_car(body)))
+            return eval_variable(get_car(body), newenv, body);
+        expr = get_car(body);
+        env = newenv;
+        goto eval_start;
+    } else if (p.type() == TMACRO) {
+        auto it = expansions.find(expr.index());
+        if (it != expansions.end() && eq(it->second.macro, p)) {
+            expr = it->second.form;
+            env = orig_env;
+            goto eval_start;
+        }
+        args = get_cdr(expr);
+        // apply and eval
+        auto body = make_ptr(), newenv = make_ptr();
+        root_guard g1(body), g2(newenv);
+        body = procedure_body(p);
+        newenv = make_frame(procedure_formals(p), args, procedure_env(p));
+        if (eq(body, s_nil)) return s_nil;
+        if (profiling) prof.enter(p.index(), TMACRO, true);
+        while (!eq(get_cdr(body), s_nil)) {
+            eval_car(body, newenv);
+            body = get_cdr(body);
+        }
+        auto expansion = eval_car(body, newenv);
+        if (profiling) prof.exit();
+        // expand each call site once, unless the operator is an expression
+        // that may yield a different macro every time
+        if (variable_p(get_car(expr))) {
+            expansions[expr.index()] = {p, expansion};
+            young_expansions.push_back(expr.index());
+        }
+        expr = expansion;
+        env = orig_env;
+        goto eval_start;
+    }
+    ERR_EXIT("Eval: unknown expression type");
+}
+
+// Bytecode engine: s-expressions are compiled, after macro expansion, into
+// code objects whose slot 0 holds the formals and the rest constants.
+// Variables bound by an enclosing lambda are addressed by (depth, slot);
+// other names are looked up in the environment at run time.
+#define VM_OPCODES(X) \
+    X(OP_CONST)       \
+    X(OP_LREF)        \
+    X(OP_NREF)        \
+    X(OP_LSET)        \
+    X(OP_NSET)        \
+    X(OP_POP)         \
+    X(OP_JUMP)        \
+    X(OP_JUMPF)       \
+    X(OP_CLOSURE)     \
+    X(OP_CALL)        \
+    X(OP_TCALL)       \
+    X(OP_RET)
+
+enum opcode {
+#define X(op) op,
+    VM_OPCODES(X)
+#undef X
+};
+
+bool use_vm = false;
+
+struct vm_frame {
+    int pc;
+    size_t base;
+    bool owns_env;  // whether the environment was made for this call
+    bool profiled;  // whether the profiler has a call open for it
+};
+vector<vm_frame> vm_frames;
+
+ptr env_at(ptr env, int depth) {
+    for (; depth > 0; depth--) env = object_slots(env)[0];
+    return env;
+}
+
+ptr vm_execute(ptr code, ptr env);
+ptr vm_run(size_t entry, bool at_call = false);
+// Makes the non-tail call of the n arguments on top of the value stack if
+// it is to a compiled procedure, running its native function directly and
+// leaving the result in place of the function; returns false otherwise.
+bool vm_call_native(size_t n);
+// Replaces the current frame with that of the tail call of the n arguments
+// on top of the value stack if it is to a compiled procedure; returns false
+// otherwise. Native code then returns VM_TAIL_CALL to have it run.
+bool vm_tail_native(size_t n);
+const int VM_TAIL_CALL = -2;
+
+ptr vm_apply(ptr proc, ptr args) {
+    root_guard g(proc);
+    auto env = make_frame(procedure_formals(proc), args, procedure_env(proc));
+    return vm_execute(procedure_body(proc), env);
+}
+
+// Instructions other than calls and returns, shared by vm_execute and the
+// native functions written by --compile.
+void vm_lref(ptr env, int depth, int slot) {
+    auto frame = env_at(env, depth);
+    auto val = object_slots(frame)[slot];
+    if (val.type() == TUNBOUND) unbound_variable(object_slots(frame)[slot - 1]);
+    value_stack.push_back(val);
+}
+
+// The compiler found no enclosing lambda binding sym, so it is a global
+// unless set! has since added it to one of their environments.
+void vm_nref(ptr env, ptr sym) {
+    auto bit = name_bit(sym);
+    for (auto e = env; !(objects[e.index()].names & bit);) {
+        e = object_slots(e)[0];
+        if (!eq(e, s_nil)) continue;
+        auto val = global_value(sym);
+        if (val.type() == TUNBOUND || eq(val, make_absent())) break;
+        value_stack.push_back(val);
+        return;
+    }
+    value_stack.push_back(eval_variable(sym, env));
+}
+
+void vm_lset(ptr env, int depth, int slot) {
+    object_set(env_at(env, depth), slot, value_stack.back());
+    value_stack.pop_back();
+}
+
+void vm_nset(ptr env, ptr sym) {
+    assign(env, sym, value_stack.back());
+    value_stack.pop_back();
+}
+
+// Pops the value an OP_JUMPF tests and returns whether it jumps.
+bool vm_false() {
+    auto p = value_stack.back();
+    value_stack.pop_back();
+    return eq(p, s_nil);
+}
+
+void vm_closure(ptr env, ptr code, int type) {
+    value_stack.push_back(
+        make_procedure(object_slots(code)[0], code, env, (type_t)type));
+}
+
+// Makes the call of the n arguments on top of the value stack if it is to
+// a primitive other than eval and apply, leaving the result in place of
+// the function; returns false otherwise.
+bool vm_call_primitive(size_t n) {
+    auto base = value_stack.size() - n;
+    auto f = value_stack[base - 1];
+    if (f.type() != TPRIM) return false;
+    auto fn = primitives[f.index()].fn;
+    if (fn == eval_prim || fn == apply_prim) return false;
+    auto r = call_primitive(f, value_stack.data() + base, n);
+    value_stack.resize(base - 1);
+    value_stack.push_back(r);
+    return true;
+}
+
+// Formals of the lambdas enclosing the code being compiled, innermost first.
+struct scope {
+    vector<int> names;
+    const scope *parent;
+};
+
+struct compiler {
+    vector<int> code;
+    vector<ptr> consts;
+    root_vector_guard g;
+    const scope *sc;
+    ptr globals;  // where macros are looked up
+
+    compiler(ptr formals, const scope *sc, ptr globals)
+        : consts{formals}, g(consts), sc(sc), globals(globals) {}
+
+    int constant(ptr p) {
+        for (size_t i = 1; i < consts.size(); i++)
+            if (eq(consts[i], p)) return i;
+        consts.push_back(p);
+        return consts.size() - 1;
+    }
+
+    void emit(int word) { code.push_back(word); }
+
+    // Returns whether sym is bound by an enclosing lambda, and where.
+    bool resolve(ptr sym, int &depth, int &slot) {
+        depth = 0;
+        for (auto s = sc; s; s = s->parent, depth++) {
+            for (size_t i = 0; i < s->names.size(); i++) {
+                if (s->names[i] == sym.symbol()) {
+                    slot = 2 + 2 * i;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool macro_p(ptr op, ptr &macro) {
+        int depth, slot;
+        if (op.type() != TSYM || resolve(op, depth, slot)) return false;
+        long long s, d;
+        auto frame = lookup(globals, op, s, d);
+        if (eq(frame, s_nil)) return false;
+        macro = binding_value(frame, s, op);
+        return macro.type() == TMACRO;
+    }
+
+    void compile_body(ptr body) {
+        root_guard g(body);
+        if (eq(body, s_nil)) emit(OP_CONST), emit(constant(s_nil));
+        for (; body.type() == TCONS; body = get_cdr(body)) {
+            compile(get_car(body), eq(get_cdr(body), s_nil));
+            if (!eq(get_cdr(body), s_nil)) emit(OP_POP);
+        }
+        emit(OP_RET);
+    }
+
+    void compile_lambda(ptr expr, type_t type) {
+        scope inner{{}, sc};
+        auto formals = get_car(get_cdr(expr));
+        auto f = formals;
+        for (; f.type() == TCONS; f = get_cdr(f))
+            inner.names.push_back(get_car(f).symbol());
+        if (f.type() == TSYM && !eq(f, s_nil))
+            inner.names.push_back(f.symbol());
+        compiler c(formals, &inner, globals);
+        c.compile_body(get_cdr(get_cdr(expr)));
+        auto k = constant(c.finish());
+        emit(OP_CLOSURE), emit(k), emit(type);
+    }
+
+    void compile(ptr expr, bool tail) {
+        root_guard g(expr);
+        int depth, slot;
+        if (expr.type() == TSYM) {
+            if (eq(expr, s_nil) || eq(expr, s_t)) {
+                emit(OP_CONST), emit(constant(expr));
+            } else if (resolve(expr, depth, slot)) {
+                emit(OP_LREF), emit(depth), emit(slot);
+            } else {
+                emit(OP_NREF), emit(constant(expr));
+            }
+            return;
+        }
+        if (expr.type() != TCONS) {
+            emit(OP_CONST), emit(constant(expr));
+            return;
+        }
+        auto op = get_car(expr);
+        ptr macro;
+        if (eq(op, s_quote)) {
+            emit(OP_CONST), emit(constant(get_car(get_cdr(expr))));
+        } else if (eq(op, s_if)) {
+            auto branches = get_cdr(get_cdr(expr));
+            compile(get_car(get_cdr(expr)), false);
+            emit(OP_JUMPF), emit(0);
+            auto to_else = code.size();
+            compile(get_car(get_cdr(get_cdr(expr))), tail);
+            emit(OP_JUMP), emit(0);
+            auto to_end = code.size();
+            code[to_else - 1] = code.size() - to_else;
+            branches = get_cdr(get_cdr(get_cdr(expr)));
+            if (eq(branches, s_nil))
+                emit(OP_CONST), emit(constant(s_nil));
+            else
+                compile(get_car(branches), tail);
+            code[to_end - 1] = code.size() - to_end;
+        } else if (eq(op, s_set)) {
+            auto sym = get_car(get_cdr(expr));
+            compile(get_car(get_cdr(get_cdr(expr))), false);
+            if (sym.type() == TSYM && resolve(sym, depth, slot))
+                emit(OP_LSET), emit(depth), emit(slot);
+            else
+                emit(OP_NSET), emit(constant(sym));
+            emit(OP_CONST), emit(constant(sym));
+        } else if (eq(op, s_lambda)) {
+            compile_lambda(expr, TPROC);
+        } else if (eq(op, s_syntax)) {
+            compile_lambda(expr, TMACRO);
+        } else if (macro_p(op, macro)) {
+            if (profiling) prof.enter(macro.index(), TMACRO, true);
+            auto expansion = vm_apply(macro, get_cdr(expr));
+            if (profiling) prof.exit();
+            compile(expansion, tail);
+        } else {
+            compile(op, false);
+            int n = 0;
+            auto args = get_cdr(expr);
+            root_guard ga(args);
+            for (; args.type() == TCONS; args = get_cdr(args), n++)
+                compile(get_car(args), false);
+            emit(tail ? OP_TCALL : OP_CALL), emit(n);
+        }
+    }
+
+    ptr finish() {
+        auto obj = make_object(TCODE, 0, s_nil);
+        // a new object needs no write barrier
+        objects[obj.index()].slots.assign(consts.begin(), consts.end());
+        objects[obj.index()].code.assign(code.begin(), code.end());
+        return obj;
+    }
+};
+
+// Compiles expr into the body of a call with no arguments in env.
+ptr vm_compile(ptr expr, ptr env) {
+    root_guard g(env);
+    compiler c(s_nil, nullptr, env);
+    c.compile(expr, true);
+    c.emit(OP_RET);
+    return c.finish();
+}
+
+// With --compile, the code objects of the top-level forms loaded so far.
+const char *compile_path = nullptr;
+vector<ptr> compiled_log;
+
+ptr vm_eval(ptr expr, ptr env) {
+    root_guard g(env);
+    auto code = vm_compile(expr, env);
+    if (compile_path) compiled_log.push_back(code);
+    return vm_execute(code, env);
+}
+
+// Code compiled to C++ by --compile. Each code object has its constants,
+// which are either the printed form of a datum or the index of another
+// compiled code object, its instructions and its native function. A native
+// function runs the instructions from pc on and returns the pc of a call
+// it leaves to vm_execute, or -1 to return from the frame. The generated
+// file is built in by defining MEHLISP_COMPILED as its name.
+typedef int (*native_fn)(ptr env, const ptr *consts, int pc);
+
+struct compiled_constant {
+    int code;
+    const char *datum;
+};
+
+struct compiled_code {
+    vector<compiled_constant> consts;
+    vector<int> code;
+    native_fn native;
+};
+
+// A compiled file is recognized by its contents, not its name.
+struct compiled_file {
+    uint64_t size, hash;
+};
+
+// The value of the primitive called name, which native code compares
+// operators with before making calls to it inline.
+ptr primitive_named(const char *name) {
+    for (size_t i = 0; i < primitives.size(); i++)
+        if (!strcmp(primitives[i].name, name)) return make_tagged(TPRIM, i);
+    ERR_EXIT("Compiled code: no primitive %s", name);
+}
+
+#ifdef MEHLISP_COMPILED
+#include MEHLISP_COMPILED
+#else
+// the code objects, those of the top-level forms in order of evaluation,
+// and the files they come from
+const vector<compiled_code> compiled_codes;
+const vector<int> compiled_forms;
+const vector<compiled_file> compiled_files;
+const long long compiled_gensym_counter = 0;
+#endif
+
+#if defined(__GNUC__)
+#define VM_THREADED
+#endif
+
+// Runs a code object until the call it starts returns. Instructions are
+// dispatched with computed gotos where the compiler supports them.
+ptr vm_execute(ptr code, ptr env) {
+    auto entry = vm_frames.size();
+    vm_frames.push_back({0, value_stack.size(), false, false});
+    vm_frame_values.push_back(code);
+    vm_frame_values.push_back(env);
+    return vm_run(entry);
+}
+
+// Runs the frames from `entry` on until the one at `entry` returns. With
+// `at_call`, the top frame is a compiled one stopped at a call, which is
+// made by the bytecode loop.
+ptr vm_run(size_t entry, bool at_call) {
+    ptr env;
+    const int *code_base, *ip;
+    const ptr *consts;
+    native_fn native;
+    auto load = [&] {
+        auto &object = objects[vm_frame_values[vm_frame_values.size() - 2]
+                                   .index()];
+        code_base = object.code.data();
+        ip = code_base + vm_frames.back().pc;
+        consts = object.slots.data();
+        native = object.native < 0 ? nullptr
+                                   : compiled_codes[object.native].native;
+        env = vm_frame_values.back();
+    };
+    auto pop = [] {
+        auto p = value_stack.back();
+        value_stack.pop_back();
+        return p;
+    };
+    load();
+    if (native && !at_call) goto vm_native;
+#ifdef VM_THREADED
+#define X(op) &&op##_label,
+    static void *labels[] = {VM_OPCODES(X)};
+#undef X
+#define VM_CASE(op) op##_label:
+#define VM_NEXT goto *labels[*ip++]
+    VM_NEXT;
+#else
+#define VM_CASE(op) case op:
+#define VM_NEXT continue
+    for (;;) switch (*ip++) {
+#endif
+    VM_CASE(OP_CONST) {
+        value_stack.push_back(consts[*ip++]);
+        VM_NEXT;
+    }
+    VM_CASE(OP_LREF) {
+        vm_lref(env, ip[0], ip[1]);
+        ip += 2;
+        VM_NEXT;
+    }
+    VM_CASE(OP_NREF) {
+        vm_nref(env, consts[*ip++]);
+        VM_NEXT;
+    }
+    VM_CASE(OP_LSET) {
+        vm_lset(env, ip[0], ip[1]);
+        ip += 2;
+        VM_NEXT;
+    }
+    VM_CASE(OP_NSET) {
+        vm_nset(env, consts[*ip++]);
+        VM_NEXT;
+    }
+    VM_CASE(OP_POP) {
+        value_stack.pop_back();
+        VM_NEXT;
+    }
+    VM_CASE(OP_JUMP) {
+        ip += *ip + 1;
+        VM_NEXT;
+    }
+    VM_CASE(OP_JUMPF) {
+        if (vm_false())
+            ip += *ip + 1;
+        else
+            ip++;
+        VM_NEXT;
+    }
+    VM_CASE(OP_CLOSURE) {
+        vm_closure(env, consts[ip[0]], ip[1]);
+        ip += 2;
+        VM_NEXT;
+    }
+    VM_CASE(OP_CALL)
+    VM_CASE(OP_TCALL) {
+        bool tail = ip[-1] == OP_TCALL;
+        size_t n = *ip++, base = value_stack.size() - n;
+        ptr f = value_stack[base - 1], body, newenv;
+        bool owns_env = true;
+    vm_call:
+        if (f.type() == TPRIM) {
+            auto fn = primitives[f.index()].fn;
+            if (fn != eval_prim && fn != apply_prim) {
+                auto r = call_primitive(f, value_stack.data() + base, n);
+                value_stack.resize(base - 1);
+                value_stack.push_back(r);
+                if (tail) goto vm_return;
+                VM_NEXT;
+            }
+            check_arity(f, n);
+            if (fn == apply_prim) {
+                n = spread_arguments(base, n) - 1;
+                value_stack.erase(value_stack.begin() + base - 1);
+                f = value_stack[base - 1];
+                goto vm_call;
+            }
+            // eval runs its expression as a call with no arguments in the
+            // global environment
+            newenv = global_environment_of(env);
+            body = vm_compile(value_stack[base], newenv);
+            owns_env = false;
+        } else {
+            if (f.type() != TPROC || procedure_body(f).type() != TCODE) {
+                print(f, eport);
+                cerr << ": ";
+                ERR_EXIT("vm: not a compiled procedure");
+            }
+            newenv = make_frame_from_stack(procedure_formals(f), base, n,
+                                           procedure_env(f));
+            f = value_stack[base - 1];
+            body = procedure_body(f);
+        }
+        value_stack.resize(base - 1);
+        if (tail) {
+            value_stack.resize(vm_frames.back().base);
+            if (vm_frames.back().owns_env) release_frame(env);
+            if (vm_frames.back().profiled) prof.exit();
+            vm_frame_values.resize(vm_frame_values.size() - 2);
+        } else {
+            vm_frames.back().pc = ip - code_base;
+            vm_frames.push_back({0, value_stack.size(), true, false});
+        }
+        vm_frames.back().pc = 0;
+        vm_frames.back().owns_env = owns_env;
+        vm_frames.back().profiled = profiling && owns_env;
+        if (profiling && owns_env) prof.enter(f.index(), TPROC);
+        vm_frame_values.push_back(body);
+        vm_frame_values.push_back(newenv);
+        load();
+        if (native) goto vm_native;
+        VM_NEXT;
+    }
+    VM_CASE(OP_RET) {
+    vm_return:
+        auto r = pop();
+        value_stack.resize(vm_frames.back().base);
+        if (vm_frames.back().owns_env) release_frame(env);
+        if (vm_frames.back().profiled) prof.exit();
+        vm_frames.pop_back();
+        vm_frame_values.resize(vm_frame_values.size() - 2);
+        if (vm_frames.size() == entry) return r;
+        value_stack.push_back(r);
+        load();
+        if (native) goto vm_native;
+        VM_NEXT;
+    }
+    vm_native: {
+        auto pc = native(env, consts, ip - code_base);
+        if (pc == VM_TAIL_CALL) {
+            load();
+            goto vm_native;
+        }
+        if (pc < 0) goto vm_return;
+        ip = code_base + pc;
+        VM_NEXT;
+    }
+#ifndef VM_THREADED
+    }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+// Compiled code calls compiled procedures directly, on the C++ stack, while
+// less than native_stack_limit bytes of it are in use; deeper calls and
+// calls made while profiling go through the heap stack of vm_run.
+char *stack_base;
+size_t native_stack_limit;
+
+// Called from main. Native calls may use half of the stack's limit, which
+// is taken as 1 GiB if it is larger or unlimited; the rest is left for the
+// arguments, the environment and whatever runs below the deepest call.
+void init_native_stack(char *base) {
+    stack_base = base;
+    size_t size = 8 << 20;
+    rlimit limit;
+    if (!getrlimit(RLIMIT_STACK, &limit))
+        size = limit.rlim_cur == RLIM_INFINITY
+                   ? 1 << 30
+                   : min<size_t>(limit.rlim_cur, 1 << 30);
+    native_stack_limit = size / 2;
+}
+
+bool native_stack_left() {
+    char here;
+    return (size_t)(stack_base - &here) < native_stack_limit;
+}
+
+// Runs the native function of the top frame from its start, and those of
+// the compiled procedures it tail calls.
+int vm_run_native() {
+    int pc;
+    do {
+        auto &o = objects[vm_frame_values[vm_frame_values.size() - 2].index()];
+        pc = compiled_codes[o.native].native(vm_frame_values.back(),
+                                             o.slots.data(), 0);
+    } while (pc == VM_TAIL_CALL);
+    return pc;
+}
+
+// Makes the frame for a call of the n arguments on top of the value stack
+// to a compiled procedure, or returns false if they are not one.
+bool vm_native_frame(size_t n, ptr &body, ptr &newenv) {
+    auto base = value_stack.size() - n;
+    auto f = value_stack[base - 1];
+    if (f.type() != TPROC || profiling) return false;
+    body = procedure_body(f);
+    if (body.type() != TCODE || objects[body.index()].native < 0)
+        return false;
+    newenv = make_frame_from_stack(procedure_formals(f), base, n,
+                                   procedure_env(f));
+    body = procedure_body(value_stack[base - 1]);  // f may have moved
+    value_stack.resize(base - 1);
+    return true;
+}
+
+bool vm_call_native(size_t n) {
+    ptr body, newenv;
+    if (!native_stack_left() || !vm_native_frame(n, body, newenv))
+        return false;
+    auto entry = vm_frames.size();
+    vm_frames.push_back({0, value_stack.size(), true, false});
+    vm_frame_values.push_back(body);
+    vm_frame_values.push_back(newenv);
+    auto pc = vm_run_native();
+    ptr r;
+    if (pc >= 0) {
+        // it stopped at a call it cannot make itself
+        vm_frames.back().pc = pc;
+        r = vm_run(entry, true);
+    } else {
+        r = value_stack.back();
+        value_stack.resize(vm_frames.back().base);
+        release_frame(vm_frame_values.back());
+        vm_frames.pop_back();
+        vm_frame_values.resize(vm_frame_values.size() - 2);
+    }
+    value_stack.push_back(r);
+    return true;
+}
+
+bool vm_tail_native(size_t n) {
+    ptr body, newenv;
+    if (!vm_native_frame(n, body, newenv)) return false;
+    auto &frame = vm_frames.back();
+    value_stack.resize(frame.base);
+    if (frame.owns_env) release_frame(vm_frame_values.back());
+    frame = {0, frame.base, true, false};
+    vm_frame_values[vm_frame_values.size() - 2] = body;
+    vm_frame_values.back() = newenv;
+    return true;
+}
+
+ptr make_primitive(long long index) { return make_tagged(TPRIM, index); }
+
+ptr initial_environment() { return make_environment(s_nil, 0); }
+
+void populate_primitives(ptr &env) {
+    for (int i = 0; i < (int)primitives.size(); i++)
+        define(env, intern(primitives[i].name), make_primitive(i));
+}
+
+// A heap image holds everything loading files builds up: the symbol
+// table, the cells, the heap objects and the global variables. It is
+// written after a full collection, so nothing is young, and can only be
+// loaded by the binary and engine that wrote it. The nursery size is taken
+// from the image, since cell indices depend on it.
+//
+// The old space and the slots and code of the objects are saved as they
+// are laid out in memory, at offsets aligned to IMAGE_ALIGN, so loading
+// maps them copy-on-write instead of reading them: the cells in place of
+// the reserved ones, and the items where the objects borrow them.
+const char IMAGE_MAGIC[8] = {'m', 'e', 'h', 'l', 'i', 'm', 'g', '8'};
+const long long IMAGE_ALIGN = 1 << 16,
+                IMAGE_ALIGN_CELLS = IMAGE_ALIGN / sizeof(cell);
+
+struct image_header {
+    char magic[8];
+    uint64_t primitives_hash, vm;
+    uint64_t nursery_size, memory_size, bump, free_count;
+    int64_t free_head;
+    uint64_t symbols, pool_size, table_size, objects, globals;
+    uint64_t gensym_counter, env;
+    uint64_t istreams, ostreams;
+    // file offsets of cell first_cell and of the items, and their number
+    uint64_t first_cell, cells_at, items_at, nslots, ncode;
+};
+
+// A saved object: its type (0 if free), the numbers of its slots and of
+// its code words, its native function and its names mask.
+struct image_object {
+    uint64_t type, nslots, ncode;
+    int64_t native;
+    uint64_t names;
+};
+
+// Identifies the primitive table and the compiled code, since primitive
+// values and native functions are saved as indices.
+uint64_t primitives_hash() {
+    string names;
+    for (auto &prim : primitives) names += prim.name, names += ' ';
+    names += to_string(compiled_codes.size());
+    return symbol_table::hash(names.data(), names.size());
+}
+
+template <class T>
+void image_put(ofstream &out, const T *data, size_t n) {
+    out.write((const char *)data, n * sizeof(T));
+}
+
+void image_zeros(ofstream &out, long long bytes) {
+    static const char zeros[IMAGE_ALIGN] = {};
+    for (; bytes > 0; bytes -= IMAGE_ALIGN)
+        image_put(out, zeros, min(bytes, IMAGE_ALIGN));
+}
+
+// The end of the cells an image maps, which are whole aligned blocks from
+// first_cell on.
+long long image_cells_end(long long bump) {
+    return (bump + IMAGE_ALIGN_CELLS - 1) & -IMAGE_ALIGN_CELLS;
+}
+
+void dump_image(const char *path, ptr env) {
     root_guard g(env);
-    env = initial_environment();
-    populate_primitives(env);
+    if (nursery_size) gc_minor();
+    gc_cycle();
+    // written aside and renamed, since the heap may be mapped from path
+    auto temp = string(path) + ".tmp";
+    ofstream out(temp, ios::binary);
+    if (!out) ERR_EXIT("Image: cannot write %s", temp.c_str());
+    image_header h{};
+    memcpy(h.magic, IMAGE_MAGIC, sizeof h.magic);
+    h.primitives_hash = primitives_hash();
+    h.vm = use_vm;
+    h.nursery_size = nursery_size;
+    h.memory_size = memory_size;
+    h.bump = bump;
+    h.free_count = free_count;
+    h.free_head = free_head;
+    h.symbols = obarray.offsets.size();
+    h.pool_size = obarray.pool.size();
+    h.table_size = obarray.slots.size();
+    h.objects = objects.size();
+    h.globals = global_values.size();
+    h.istreams = istreams.size();
+    h.ostreams = ostreams.size();
+    h.gensym_counter = gensym_counter;
+    h.env = env.bits;
+    h.first_cell = nursery_size & -IMAGE_ALIGN_CELLS;
+    image_put(out, &h, 1);  // again below, with the offsets
+    image_put(out, obarray.pool.data(), h.pool_size);
+    image_put(out, obarray.offsets.data(), h.symbols);
+    image_put(out, obarray.lengths.data(), h.symbols);
+    image_put(out, obarray.hashes.data(), h.symbols);
+    image_put(out, obarray.slots.data(), h.table_size);
+    image_put(out, global_values.data(), h.globals);
+    for (auto &o : objects) {
+        image_object s{o.in_use ? (uint64_t)o.type : 0, o.slots.size(),
+                       o.code.size(), o.native, o.names};
+        image_put(out, &s, 1);
+        h.nslots += o.slots.size();
+        h.ncode += o.code.size();
+    }
+    // the nursery is empty after the minor collection, and the cells
+    // around the old space are saved as zeros
+    image_zeros(out, -(long long)out.tellp() & (IMAGE_ALIGN - 1));
+    h.cells_at = out.tellp();
+    image_zeros(out, (nursery_size - h.first_cell) * sizeof(cell));
+    each_cell_run(nursery_size, bump,
+                  [&](cell *cells, long long n) { image_put(out, cells, n); });
+    image_zeros(out, (image_cells_end(bump) - bump) * sizeof(cell));
+    h.items_at = out.tellp();
+    for (auto &o : objects) image_put(out, o.slots.data(), o.slots.size());
+    for (auto &o : objects) image_put(out, o.code.data(), o.code.size());
+    out.seekp(0);
+    image_put(out, &h, 1);
+    out.close();
+    if (!out || rename(temp.c_str(), path))
+        ERR_EXIT("Image: cannot write %s", path);
+}
+
+struct image_reader {
+    const char *p, *end;
+    template <class T>
+    void get(T *data, size_t n) {
+        if ((size_t)(end - p) < n * sizeof(T)) ERR_EXIT("Image: truncated");
+        memcpy((void *)data, p, n * sizeof(T));
+        p += n * sizeof(T);
+    }
+};
+
+// Maps bytes of the image file at offset copy-on-write, at addr if that is
+// not null. Mappings of the items are never undone, since objects keep
+// borrowing them.
+void *map_image(const char *path, void *addr, size_t bytes, uint64_t offset) {
+    int fd = open(path, O_RDONLY);
+    auto p = fd < 0 ? MAP_FAILED
+                    : mmap(addr, bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | (addr ? MAP_FIXED : 0), fd, offset);
+    if (fd >= 0) close(fd);
+    if (p == MAP_FAILED) ERR_EXIT("Image: cannot map %s", path);
+    return p;
+}
+
+// Restores the state saved by dump_image and returns the global
+// environment. Must be called right after gc_init.
+ptr load_image(const char *path) {
+    mapped_file m(path);
+    if (!m.data) ERR_EXIT("Image: cannot map %s", path);
+    image_reader r{m.data, m.data + m.size};
+    image_header h;
+    r.get(&h, 1);
+    if (memcmp(h.magic, IMAGE_MAGIC, sizeof h.magic))
+        ERR_EXIT("Image: %s is not a heap image", path);
+    if (h.primitives_hash != primitives_hash())
+        ERR_EXIT("Image: written by a different build");
+    if (h.vm != use_vm) ERR_EXIT("Image: written for the other engine");
+    long long cells_end = image_cells_end(h.bump);
+    size_t cell_bytes = (cells_end - h.first_cell) * sizeof(cell),
+           item_bytes = h.nslots * sizeof(ptr) + h.ncode * sizeof(int);
+    if (h.cells_at + cell_bytes > m.size || h.items_at + item_bytes > m.size)
+        ERR_EXIT("Image: truncated");
+    obarray.pool.resize(h.pool_size);
+    r.get(&obarray.pool[0], h.pool_size);
+    obarray.offsets.resize(h.symbols);
+    obarray.lengths.resize(h.symbols);
+    obarray.hashes.resize(h.symbols);
+    obarray.slots.resize(h.table_size);
+    r.get(obarray.offsets.data(), h.symbols);
+    r.get(obarray.lengths.data(), h.symbols);
+    r.get(obarray.hashes.data(), h.symbols);
+    r.get(obarray.slots.data(), h.table_size);
+    global_values.resize(h.globals);
+    r.get(global_values.data(), h.globals);
+    // ports opened before the image was written are closed in it; the
+    // standard ones come first and stay open
+    istreams.resize(max<size_t>(istreams.size(), h.istreams));
+    ostreams.resize(max<size_t>(ostreams.size(), h.ostreams));
+    nursery_size = h.nursery_size;
+    gc_resize(max<long long>(h.memory_size, nursery_size + heap_size));
+    if (cell_bytes)
+        map_image(path, &cell_at(h.first_cell), cell_bytes, h.cells_at);
+    bump = h.bump;
+    free_head = h.free_head;
+    free_count = h.free_count;
+    auto slots = item_bytes ? (ptr *)map_image(path, nullptr, item_bytes,
+                                               h.items_at)
+                            : nullptr;
+    auto code = (int *)(slots + h.nslots);
+    objects.resize(h.objects);
+    free_objects.clear();
+    objects_in_use = 0;
+    for (uint64_t id = 0; id < h.objects; id++) {
+        image_object s;
+        r.get(&s, 1);
+        auto &o = objects[id];
+        o.type = (type_t)s.type;
+        o.native = s.native;
+        o.names = s.names;
+        o.in_use = s.type != 0;
+        o.young = o.mark = o.remembered = o.region = 0;
+        o.slots.borrow(slots, s.nslots);
+        o.code.borrow(code, s.ncode);
+        slots += s.nslots;
+        code += s.ncode;
+        if (o.in_use)
+            objects_in_use++;
+        else
+            free_objects.push_back(id);
+    }
+    gensym_counter = h.gensym_counter;
+    ptr env;
+    env.bits = h.env;
+    return env;
+}
+
+const char *image_path = nullptr, *dump_image_path = nullptr;
+// files after --batch are run as separate jobs, on this many processes
+long long batch_from = -1;
+int batch_jobs = thread::hardware_concurrency();
+
+// Options are read from the environment first and then from the command
+// line; every other argument is a file to load, with - meaning stdin.
+vector<const char *> parse_options(int argc, char **argv) {
+    // binaries with compiled libraries run on the virtual machine
+    use_vm = !compiled_codes.empty();
+    if (auto s = getenv("MEHLISP_HEAP_SIZE")) heap_size = atoll(s);
+    if (auto s = getenv("MEHLISP_NURSERY_SIZE")) nursery_size = atoll(s);
+    if (auto s = getenv("MEHLISP_HEAP_GROWTH")) growth_factor = atof(s);
+    if (auto s = getenv("MEHLISP_GC_THREADS")) gc_threads = atoi(s);
+    if (auto s = getenv("MEHLISP_PARALLEL_MARK_MIN"))
+        parallel_mark_min = atoll(s);
+    if (auto s = getenv("MEHLISP_VM")) use_vm = atoi(s);
+    if (auto s = getenv("MEHLISP_IMAGE")) image_path = s;
+    if (auto s = getenv("MEHLISP_STATS")) print_stats = atoi(s);
+    if (auto s = getenv("MEHLISP_PROFILE")) profile_path = s;
+    if (auto s = getenv("MEHLISP_JOBS")) batch_jobs = atoi(s);
+    vector<const char *> files;
     for (int i = 1; i < argc; i++) {
-        bool filep = strcmp(argv[i], "-");
-        ifstream st;
-        if (filep) {
-            st.open(argv[i]);
-            iport = make_input_port(&st);
+        if (!strcmp(argv[i], "--heap-size") && i + 1 < argc)
+            heap_size = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--nursery-size") && i + 1 < argc)
+            nursery_size = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--heap-growth") && i + 1 < argc)
+            growth_factor = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--gc-threads") && i + 1 < argc)
+            gc_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--parallel-mark-min") && i + 1 < argc)
+            parallel_mark_min = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--vm"))
+            use_vm = true;
+        else if (!strcmp(argv[i], "--stats"))
+            print_stats = true;
+        else if (!strcmp(argv[i], "--profile") && i + 1 < argc)
+            profile_path = argv[++i];
+        else if (!strcmp(argv[i], "--compile") && i + 1 < argc)
+            compile_path = argv[++i], use_vm = true;
+        else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+            batch_jobs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--batch"))
+            batch_from = files.size();
+        else if (!strcmp(argv[i], "--image") && i + 1 < argc)
+            image_path = argv[++i];
+        else if (!strcmp(argv[i], "--dump-image") && i + 1 < argc)
+            dump_image_path = argv[++i];
+        else
+            files.push_back(argv[i]);
+    }
+    if (heap_size < 1) ERR_EXIT("Options: heap size must be positive");
+    if (nursery_size < 0) ERR_EXIT("Options: nursery size must be >= 0");
+    if (!(growth_factor > 1)) ERR_EXIT("Options: growth factor must be > 1");
+    if (batch_jobs < 1) batch_jobs = 1;
+    return files;
+}
+
+// Ahead-of-time compilation (--compile FILE): the files are loaded on the
+// virtual machine as usual, then the code objects of their top-level forms
+// and all code those contain are written to FILE as C++. Each instruction
+// becomes C++ with its operands built in: local variables are read from
+// their environments directly, calls to a few primitives named by global
+// variables are made inline while those still hold them, other primitives
+// are called on the spot and compiled procedures are called directly while
+// the C++ stack allows. Any other call is left to vm_run, so it goes on
+// the heap stack, and tail calls remain proper.
+
+// Returns the size and 64-bit FNV-1a hash of the contents of a regular
+// file, or nothing for stdin and what cannot be mapped.
+optional<compiled_file> file_identity(const char *file) {
+    if (!strcmp(file, "-")) return nullopt;
+    mapped_file m(file);
+    if (!m.data) return nullopt;
+    uint64_t h = 14695981039346656037u;
+    for (size_t i = 0; i < m.size; i++)
+        h = (h ^ (unsigned char)m.data[i]) * 1099511628211u;
+    return compiled_file{m.size, h};
+}
+
+// Returns whether p can be written out as a datum and read back.
+bool compilable_p(ptr p) {
+    vector<ptr> todo{p};  // nothing is allocated, so nothing moves
+    while (!todo.empty()) {
+        p = todo.back();
+        todo.pop_back();
+        if (p.type() == TCONS) {
+            todo.push_back(cell_at(p.index()).car);
+            todo.push_back(cell_at(p.index()).cdr);
+        } else if (!number_p(p) && p.type() != TSYM) {
+            return false;
+        }
+    }
+    return true;
+}
+
+string c_string(const string &s) {
+    string r = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            r += '\\', r += c;
+        } else if (c < ' ' || c > '~') {
+            char octal[8];
+            snprintf(octal, sizeof octal, "\\%03o", c);
+            r += octal;
         } else {
-            iport = make_input_port(&cin);
+            r += c;
         }
-        while (true) {
-            if (!filep) cout << "> " << flush;
-            ptr p = make_ptr(), q = make_ptr();
-            root_guard g1(p), g2(q);
-            p = read(iport);
-            if (eq(p, make_eof())) break;
-            q = eval(p, env);
-            if (!filep) {
-                print(q, oport);
-                cout << endl;
+    }
+    return r + "\"";
+}
+
+int instruction_size(int op) {
+    return op == OP_POP || op == OP_RET                       ? 1
+           : op == OP_LREF || op == OP_LSET || op == OP_CLOSURE ? 3
+                                                                : 2;
+}
+
+// Primitives that native code applies inline, guarded by a check that the
+// operator is still the primitive and that the operands need no more than
+// the test: to the value stack from the operator on, s, it applies either a
+// value or, for a predicate, a condition.
+struct inline_primitive {
+    const char *name;
+    size_t n;
+    const char *test, *value, *condition;
+};
+const char *FIXNUMS = "s[1].type() == TFIX && s[2].type() == TFIX";
+const inline_primitive inline_primitives[] = {
+    {"car", 1, "s[1].type() == TCONS", "cell_at(s[1].index()).car", nullptr},
+    {"cdr", 1, "s[1].type() == TCONS", "cell_at(s[1].index()).cdr", nullptr},
+    {"cons", 2, "true", "cons(s[1], s[2])", nullptr},
+    // fixnums are 44 bits wide, so these cannot overflow a long long
+    {"+", 2, FIXNUMS, "make_integer(s[1].fixnum() + s[2].fixnum())", nullptr},
+    {"-", 2, FIXNUMS, "make_integer(s[1].fixnum() - s[2].fixnum())", nullptr},
+    {"null", 1, "true", nullptr, "eq(s[1], s_nil)"},
+    {"eq", 2, "true", nullptr, "eq(s[1], s[2])"},
+    {"=", 2, FIXNUMS, nullptr, "eq(s[1], s[2])"},
+    {"<", 2, FIXNUMS, nullptr, "s[1].fixnum() < s[2].fixnum()"},
+};
+
+// Returns the inline primitive the code calls at pc, if its operator is a
+// global variable of that name given the right number of arguments. Which
+// instruction pushed each value is followed through the code; jumps only
+// lead forward, and where they join, values pushed differently count as
+// unknown.
+vector<const inline_primitive *> inline_calls(
+    const object_vector<int> &code, const object_vector<ptr> &consts) {
+    vector<const inline_primitive *> calls(code.size());
+    map<size_t, vector<int>> joins;
+    vector<int> stack;  // the pc of the instruction that pushed each value
+    bool reachable = true;
+    auto join = [&](size_t target) {
+        auto it = joins.find(target);
+        if (it == joins.end()) {
+            joins[target] = stack;
+            return;
+        }
+        for (size_t i = 0; i < min(stack.size(), it->second.size()); i++)
+            if (it->second[i] != stack[i]) it->second[i] = -1;
+    };
+    for (size_t pc = 0; pc < code.size(); pc += instruction_size(code[pc])) {
+        auto it = joins.find(pc);
+        if (it != joins.end()) {
+            if (reachable) join(pc);
+            stack = it->second;
+            reachable = true;
+        }
+        if (!reachable) continue;
+        auto a = pc + 1 < code.size() ? code[pc + 1] : 0;
+        switch (code[pc]) {
+        case OP_CONST:
+        case OP_LREF:
+        case OP_NREF:
+        case OP_CLOSURE:
+            stack.push_back(pc);
+            break;
+        case OP_LSET:
+        case OP_NSET:
+        case OP_POP:
+            stack.pop_back();
+            break;
+        case OP_JUMPF:
+            stack.pop_back();
+            join(pc + 2 + a);
+            break;
+        case OP_JUMP:
+            join(pc + 2 + a);
+            reachable = false;
+            break;
+        case OP_CALL:
+        case OP_TCALL: {
+            auto f = stack[stack.size() - a - 1];
+            if (f >= 0 && code[f] == OP_NREF &&
+                consts[code[f + 1]].type() == TSYM)
+                for (auto &p : inline_primitives)
+                    if (p.n == (size_t)a &&
+                        p.name == obarray.name(consts[code[f + 1]].symbol()))
+                        calls[pc] = &p;
+            stack.resize(stack.size() - a - 1);
+            stack.push_back(pc);
+            if (code[pc] == OP_TCALL) reachable = false;
+            break;
+        }
+        case OP_RET:
+            reachable = false;
+            break;
+        }
+    }
+    return calls;
+}
+
+// Writes the fast path of an inline primitive call of the code at pc,
+// which is followed by the instruction at `next`. A predicate followed by
+// OP_JUMPF jumps on its condition without pushing it.
+void write_inline_call(ostream &out, const object_vector<int> &code,
+                       size_t pc, size_t next, const inline_primitive &p) {
+    out << "    {\n        auto s = &value_stack.back() - " << p.n << ";\n"
+        << "        if (s[0].bits == inline_primitive_"
+        << &p - inline_primitives << ".bits";
+    if (strcmp(p.test, "true")) out << " && " << p.test;
+    out << ") {\n";
+    if (p.condition && code[pc] == OP_CALL && next < code.size() &&
+        code[next] == OP_JUMPF) {
+        out << "            bool c = " << p.condition << ";\n"
+            << "            value_stack.resize(value_stack.size() - "
+            << p.n + 1 << ");\n"
+            << "            if (c) goto L" << next + 2 << ";\n"
+            << "            goto L" << next + 2 + code[next + 1] << ";\n";
+    } else {
+        out << "            auto r = ";
+        if (p.condition)
+            out << "(" << p.condition << ") ? s_t : s_nil;\n";
+        else
+            out << p.value << ";\n";
+        out << "            value_stack.resize(value_stack.size() - " << p.n
+            << ");\n            value_stack.back() = r;\n";
+        if (code[pc] == OP_CALL)
+            out << "            goto L" << next << ";\n";
+        else
+            out << "            return -1;\n";
+    }
+    out << "        }\n    }\n";
+}
+
+void write_native(ostream &out, int index, const object_vector<int> &code,
+                  const object_vector<ptr> &consts) {
+    auto calls = inline_calls(code, consts);
+    // labels go where jumps lead and where calls return
+    vector<char> label(code.size() + 1), resume(code.size() + 1);
+    for (size_t pc = 0; pc < code.size(); pc += instruction_size(code[pc])) {
+        if (code[pc] == OP_JUMP || code[pc] == OP_JUMPF)
+            label[pc + 2 + code[pc + 1]] = 1;
+        if (code[pc] == OP_CALL) label[pc + 2] = resume[pc + 2] = 1;
+        // an inline predicate jumps past the OP_JUMPF after it
+        if (calls[pc] && calls[pc]->condition && code[pc] == OP_CALL &&
+            pc + 2 < code.size() && code[pc + 2] == OP_JUMPF)
+            label[pc + 4] = 1;
+    }
+    out << "int native_" << index << "(ptr env, const ptr *k, int pc) {\n";
+    if (count(resume.begin(), resume.end(), 1)) {
+        out << "    switch (pc) {\n";
+        for (size_t pc = 0; pc < resume.size(); pc++)
+            if (resume[pc])
+                out << "    case " << pc << ":\n        goto L" << pc << ";\n";
+        out << "    }\n";
+    }
+    for (size_t pc = 0; pc < code.size(); pc += instruction_size(code[pc])) {
+        if (label[pc]) out << "L" << pc << ":\n";
+        auto a = pc + 1 < code.size() ? code[pc + 1] : 0;
+        auto b = pc + 2 < code.size() ? code[pc + 2] : 0;
+        if (calls[pc]) write_inline_call(out, code, pc, pc + 2, *calls[pc]);
+        out << "    ";
+        switch (code[pc]) {
+        case OP_CONST:
+            out << "value_stack.push_back(k[" << a << "]);\n";
+            break;
+        case OP_LREF:
+            // the environment is found at compile time
+            out << "{\n        auto &slots = object_slots(";
+            for (int d = 0; d < a; d++) out << "object_slots(";
+            out << "env";
+            for (int d = 0; d < a; d++) out << ")[0]";
+            out << ");\n        if (slots[" << b
+                << "].type() == TUNBOUND) unbound_variable(slots[" << b - 1
+                << "]);\n        value_stack.push_back(slots[" << b
+                << "]);\n    }\n";
+            break;
+        case OP_NREF:
+            out << "vm_nref(env, k[" << a << "]);\n";
+            break;
+        case OP_LSET:
+            out << "vm_lset(env, " << a << ", " << b << ");\n";
+            break;
+        case OP_NSET:
+            out << "vm_nset(env, k[" << a << "]);\n";
+            break;
+        case OP_POP:
+            out << "value_stack.pop_back();\n";
+            break;
+        case OP_JUMP:
+            out << "goto L" << pc + 2 + a << ";\n";
+            break;
+        case OP_JUMPF:
+            out << "if (vm_false()) goto L" << pc + 2 + a << ";\n";
+            break;
+        case OP_CLOSURE:
+            out << "vm_closure(env, k[" << a << "], "
+                << (b == TMACRO ? "TMACRO" : "TPROC") << ");\n";
+            break;
+        case OP_CALL:
+            out << "if (!vm_call_primitive(" << a << ") && !vm_call_native("
+                << a << "))\n        return " << pc << ";\n";
+            break;
+        case OP_TCALL:
+            out << "if (vm_call_primitive(" << a << ")) return -1;\n"
+                << "    return vm_tail_native(" << a << ") ? VM_TAIL_CALL : "
+                << pc << ";\n";
+            break;
+        case OP_RET:
+            out << "return -1;\n";
+            break;
+        }
+    }
+    out << "}\n\n";
+}
+
+void write_compiled(const char *path, const vector<const char *> &files) {
+    vector<ptr> codes;
+    unordered_map<long long, int> index;
+    for (auto c : compiled_log) {
+        index[c.index()] = codes.size();
+        codes.push_back(c);
+    }
+    for (size_t i = 0; i < codes.size(); i++)
+        for (auto q : object_slots(codes[i]))
+            if (q.type() == TCODE && !index.count(q.index())) {
+                index[q.index()] = codes.size();
+                codes.push_back(q);
             }
+    ofstream out(path);
+    if (!out) ERR_EXIT("Compile: cannot write %s", path);
+    out << "// Generated by mehlisp --compile from";
+    for (auto f : files) out << " " << f;
+    out << ".\n\n";
+    for (size_t i = 0; i < size(inline_primitives); i++)
+        out << "const ptr inline_primitive_" << i << " = primitive_named("
+            << c_string(inline_primitives[i].name) << ");\n";
+    out << "\n";
+    for (size_t i = 0; i < codes.size(); i++)
+        write_native(out, i, objects[codes[i].index()].code,
+                     object_slots(codes[i]));
+    // floats are printed in hexadecimal, so they read back exactly and stay
+    // floats even when their value is integral
+    ostringstream text;
+    text << hexfloat;
+    auto port = make_output_port(&text);
+    out << "const vector<compiled_code> compiled_codes{\n";
+    for (size_t i = 0; i < codes.size(); i++) {
+        out << "    {{";
+        for (auto q : object_slots(codes[i])) {
+            if (q.type() == TCODE) {
+                out << "{" << index[q.index()] << ", nullptr}, ";
+                continue;
+            }
+            if (!compilable_p(q)) {
+                print(q, eport);
+                ERR_EXIT(": cannot be compiled");
+            }
+            text.str("");
+            print(q, port);
+            out << "{-1, " << c_string(text.str()) << "}, ";
         }
-        if (filep) {
-            st.close();
-        } else {
+        out << "},\n     {";
+        for (auto word : objects[codes[i].index()].code) out << word << ", ";
+        out << "},\n     native_" << i << "},\n";
+    }
+    ostreams[port.index()] = nullptr;  // text goes away on return
+    out << "};\nconst vector<int> compiled_forms{";
+    for (size_t i = 0; i < compiled_log.size(); i++) out << i << ", ";
+    out << "};\nconst vector<compiled_file> compiled_files{";
+    for (auto f : files) {
+        // stdin cannot be recognized later, so it is always loaded again
+        if (auto c = file_identity(f))
+            out << "{" << c->size << "u, " << c->hash << "u}, ";
+    }
+    out << "};\nconst long long compiled_gensym_counter = " << gensym_counter
+        << ";\n";
+    if (!out) ERR_EXIT("Compile: cannot write %s", path);
+}
+
+// Creates the code objects of the built-in compiled libraries and runs
+// their top-level forms in env.
+void load_compiled(ptr env) {
+    root_guard g(env);
+    vector<ptr> codes;
+    root_vector_guard gc(codes);
+    for (size_t i = 0; i < compiled_codes.size(); i++) {
+        codes.push_back(make_object(TCODE, 0, s_nil));
+        auto &o = objects[codes.back().index()];
+        auto &code = compiled_codes[i].code;
+        o.code.assign(code.begin(), code.end());
+        o.native = i;
+    }
+    for (size_t i = 0; i < compiled_codes.size(); i++) {
+        for (auto &c : compiled_codes[i].consts) {
+            if (c.code >= 0) {
+                object_push(codes[i], codes[c.code]);
+                continue;
+            }
+            buffer_reader r(c.datum, strlen(c.datum));
+            auto datum = r.read();
+            object_push(codes[i], datum);
+        }
+    }
+    // symbols made by gensym before the libraries were compiled are in
+    // their code
+    gensym_counter = max(gensym_counter, compiled_gensym_counter);
+    for (auto i : compiled_forms) vm_execute(codes[i], env);
+}
+
+bool compiled_loaded = false;
+
+// Returns whether file is one of the compiled libraries in use, which are
+// not loaded again.
+bool compiled_file_p(const char *file) {
+    if (!compiled_loaded) return false;
+    auto c = file_identity(file);
+    if (!c) return false;
+    for (auto &f : compiled_files)
+        if (f.size == c->size && f.hash == c->hash) return true;
+    return false;
+}
+
+// Evaluates the forms in file, or reads them from stdin with a prompt and
+// prints their values if file is -.
+void load_file(const char *file, ptr &env) {
+    if (compiled_file_p(file)) return;
+    bool filep = strcmp(file, "-");
+    if (filep) {
+        mapped_file m(file);
+        if (m.data) {
+            buffer_reader r(m.data, m.size);
+            while (true) {
+                ptr p = make_ptr();
+                root_guard g1(p);
+                p = r.read();
+                if (eq(p, make_eof())) break;
+                use_vm ? vm_eval(p, env) : eval(p, env);
+            }
+            return;
+        }
+    }
+    ifstream st;
+    if (filep) {
+        st.open(file);
+        iport = make_input_port(&st);
+    } else {
+        iport = make_input_port(&cin);
+    }
+    while (true) {
+        if (!filep) cout << "> " << flush;
+        ptr p = make_ptr(), q = make_ptr();
+        root_guard g1(p), g2(q);
+        p = read(iport);
+        if (eq(p, make_eof())) break;
+        q = use_vm ? vm_eval(p, env) : eval(p, env);
+        if (!filep) {
+            print(q, oport);
             cout << endl;
         }
     }
+    if (filep) {
+        // the port must not outlive the stream
+        istreams[iport.index()] = nullptr;
+        st.close();
+    } else {
+        cout << endl;
+    }
+}
+
+// Batch mode: every job file runs in a child forked from the interpreter
+// once the preloaded files are in, so the children share their heap
+// copy-on-write and each goes on with a private copy. At most `jobs`
+// children run at once; their output is collected through pipes and
+// copied to stdout in job order. Returns whether all jobs succeeded.
+bool run_batch(const vector<string> &files, int jobs, ptr &env) {
+    struct job {
+        pid_t pid;
+        int fd;
+        string out;
+        bool done;
+    };
+    vector<job> state(files.size());
+    size_t next = 0, printed = 0, running = 0;
+    bool ok = true;
+    // or the children would write out what is buffered again
+    flush_output_ports();
+    while (printed < files.size()) {
+        for (; running < (size_t)jobs && next < files.size(); next++) {
+            int fds[2];
+            if (pipe(fds)) ERR_EXIT("Batch: cannot create a pipe");
+            auto pid = fork();
+            if (pid < 0) ERR_EXIT("Batch: cannot fork");
+            if (pid == 0) {
+                close(fds[0]);
+                dup2(fds[1], 1);
+                close(fds[1]);
+                profiling = false;
+                load_file(files[next].c_str(), env);
+                cout.flush();
+                exit(0);
+            }
+            close(fds[1]);
+            state[next] = {pid, fds[0], "", false};
+            running++;
+        }
+        vector<pollfd> polls;
+        vector<size_t> ids;
+        for (size_t i = printed; i < next; i++)
+            if (!state[i].done) {
+                polls.push_back({state[i].fd, POLLIN, 0});
+                ids.push_back(i);
+            }
+        if (poll(polls.data(), polls.size(), -1) < 0) continue;
+        for (size_t k = 0; k < polls.size(); k++) {
+            if (!polls[k].revents) continue;
+            auto &j = state[ids[k]];
+            char buf[1 << 14];
+            auto n = read(j.fd, buf, sizeof buf);
+            if (n > 0 || (n < 0 && errno == EINTR)) {
+                if (n > 0) j.out.append(buf, n);
+                continue;
+            }
+            close(j.fd);
+            int status;
+            waitpid(j.pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+                cerr << files[ids[k]] << ": job failed" << endl;
+                ok = false;
+            }
+            j.done = true;
+            running--;
+        }
+        for (; printed < next && state[printed].done; printed++) {
+            cout << state[printed].out << flush;
+            string().swap(state[printed].out);
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    char stack_top;
+    init_native_stack(&stack_top);
+    auto files = parse_options(argc, argv);
+    // reported from exit so runs that stop on an error are covered too
+    if (print_stats) atexit(report_gc_stats);
+    if (profile_path && *profile_path) {
+        profiling = true;
+        atexit(report_profile);
+    }
+    gc_init();
+    ptr env = make_ptr();
+    root_guard g(env);
+    if (image_path) {
+        env = load_image(image_path);
+    } else {
+        env = initial_environment();
+        populate_primitives(env);
+        if (use_vm && !compiled_codes.empty() && !compile_path) {
+            load_compiled(env);
+            compiled_loaded = true;
+        }
+    }
+    root_vector_guard gl(compiled_log);
+    if (batch_from < 0) {
+        for (auto file : files) load_file(file, env);
+    } else {
+        for (long long i = 0; i < batch_from; i++) load_file(files[i], env);
+        // with no job files listed, their names are read from stdin
+        vector<string> jobs(files.begin() + batch_from, files.end());
+        string line;
+        if (jobs.empty())
+            while (getline(cin, line))
+                if (!line.empty()) jobs.push_back(line);
+        if (!run_batch(jobs, batch_jobs, env)) exit(1);
+    }
+    if (compile_path) write_compiled(compile_path, files);
+    if (dump_image_path) dump_image(dump_image_path, env);
 }
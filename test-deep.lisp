@@ -0,0 +1,8 @@
+; non-tail recursion much deeper than the C++ stack allows; bindings->formals
+; is compiled code in mehlisp-compiled
+(define (pairs n acc)
+  (if (= n 0) acc (pairs (- n 1) (cons (list n n) acc))))
+(define formals (bindings->formals (pairs 300000 nil)))
+(println (car formals))
+(define (last l) (if (null (cdr l)) (car l) (last (cdr l))))
+(println (last formals))
@@ -0,0 +1,14 @@
+(define out (open-output-file 'test.io))
+(write-char 104 out)
+(write-line (vector 105 33) out)
+(close-port out)
+(define out (open-output-file 'test.io t))
+(display '(1 . 2) out)
+(newline out)
+(println (close-port out))
+(println (close-port out))
+(define in (open-input-file 'test.io))
+(println (read-line in))
+(println (read in))
+(println (close-port in))
+(println (close-port in))
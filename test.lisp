@@ -66,3 +66,83 @@
   (println (odd? 12))
   (println (even? 13))
   (println (odd? 13)))
+
+(set! counter 0)
+(set! bump (lambda () (set! counter (+ counter 1))))
+(bump)
+(bump)
+(println counter)
+(println (* 123456 1000000))
+(println (* 4000000 4000000))
+(println (+ 8796093022207 1))
+(println (- 5))
+(println (/ 6 3))
+(println (/ 1 2))
+(println (= 1 1.0))
+(println (= 2 3))
+(println (eq 7 7))
+(println (+ 1.5 1))
+(println -12)
+(println 1e3)
+(println #\a)
+
+(define (adder n) (lambda (x) (+ x n)))
+(println ((adder 3) 4))
+(define saved nil)
+(define (keep a b) (let ((c (+ a b))) (set! saved (lambda () (list a b c))) c))
+(println (keep 1 2))
+(println (saved))
+(define (down x) (if (= x 0) (lambda () 'bottom) (down (- x 1))))
+(println ((down 50)))
+(println (< 1 2 3.5))
+(println (< 2 1))
+(println (symbolp (car (car (gc-stats)))))
+(define v (make-vector 3 0))
+(vector-set! v 1 'a)
+(println v)
+(println (vector-copy (list->vector '(1 2 3 4)) 1 3))
+(println (vector->list (vector 1 2)))
+(println (vector-sum (vector 1 2 3.5)))
+(println (vector-dot (vector 1 2 3) (vector 4 5 6)))
+(define table (make-hash-table))
+(hash-table-put! table 'a 1)
+(hash-table-put! table (list 1) 2)
+(hash-table-put! table 'a 3)
+(println (hash-table-get table 'a))
+(println (hash-table-get table (list 1) 'missing))
+(println (hash-table-delete! table 'a))
+(println (hash-table-count table))
+(println (eval '(+ 1 2)))
+(println (apply + 1 2 '(3 4)))
+(define (spin n) (if (= n 0) 'done (apply spin (list (- n 1)))))
+(println (spin 100000))
+(println (cons 'a (cons '(b . c) (cons (vector 1 2) 'd))))
+(define in (open-input-file 'stdlib.lisp))
+(println (car (read in)))
+(println (vector-length (read-line in)))
+(println (vector-ref (read-line in) 0))
+(define out (open-output-file '/dev/null))
+(display 'ignored out)
+(write-line (vector 104 105) out)
+(close-port out)
+(flush-output)
+(println (close-port in))
+
+; evaluating code leaves it unchanged, and a form spliced under a shadowing
+; lambda sees the inner binding
+(define code '(lambda (x) (+ x 1)))
+(println ((eval code) 2))
+(println (eq (car (cdr (car (cdr (cdr code))))) 'x))
+(set! shadow (syntax (e)
+               (list 'list (list (list 'lambda '(w) e) 0)
+                     (list (list 'lambda '(y) e) ''(inner)))))
+(define (shadowed y) (shadow (car y)))
+(println (shadowed '(outer)))
+(println (shadowed '(outer)))
+
+; expanding a macro call leaves the call as it was
+(define expr '(and a 2))
+(println (eval expr))
+(println expr)
+(println (eq (car expr) 'and))
+(println (eval expr))